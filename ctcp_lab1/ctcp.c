@@ -28,6 +28,73 @@ typedef struct unacknowledged_segment{
   uint8_t num_retransmit;
 }unacknowledged_segment_t;
 
+/**
+ * Checksum
+ *
+ * cksum_fast() computes the same Internet checksum as cksum() with a
+ * vectorized kernel: AVX2 or SSE2 on x86, chosen at run time, and a
+ * scalar loop over 64-bit words everywhere else. Data shorter than CKSUM_SHORT
+ * (headers, pure ACKs) goes straight to the scalar loop, where the call
+ * through the kernel pointer and the vector setup cost more than they
+ * save.
+ */
+#define CKSUM_SHORT 64
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CKSUM_SIMD 1
+#include <immintrin.h>
+#else
+#define CKSUM_SIMD 0
+#endif
+
+/**
+ * Object pool
+ *
+ * Fixed size objects carved out of POOL_SLAB_OBJECTS sized slabs and
+ * recycled through a free list. Slabs go back to the system only in
+ * pool_destroy(), when the connection is torn down.
+ */
+#define POOL_SLAB_OBJECTS 64
+
+typedef struct pool_slab{
+  struct pool_slab *next;
+}pool_slab_t;
+
+typedef struct pool{
+  size_t object_size;
+  void *free_list;          /* Next free object, linked through its first word */
+  pool_slab_t *slabs;
+  unsigned int in_use;
+}pool_t;
+
+/**
+ * RTT estimator
+ *
+ * Jacobson/Karels smoothed RTT and RTT variance (RFC 6298). srtt is kept
+ * scaled by 8 and rttvar by 4, all times are in ms.
+ */
+#define RTO_MIN 200             /* Lower clamp of the retransmission timeout */
+#define RTO_MAX 60000           /* Upper clamp, also caps the backoff */
+
+typedef struct rtt_estimator{
+  long srtt;                /* Smoothed RTT << 3 */
+  long rttvar;              /* RTT variance << 2 */
+  long rto;                 /* Current retransmission timeout */
+  long rto_min;
+  long rto_max;
+  bool has_sample;
+}rtt_estimator_t;
+
+/**
+ * Nagle coalescing (RFC 896)
+ *
+ * While segments are unacknowledged, a read that does not fill
+ * MAX_SEG_DATA_SIZE is held in the pending segment so that later reads
+ * can fill it up. It goes out when the unack list empties, when the
+ * segment is full, at EOF, or NAGLE_FLUSH_TIMEOUT ms after it was first
+ * held back. NAGLE_NODELAY (TCP_NODELAY) sends every read at once.
+ */
+#define NAGLE_NODELAY 0
+#define NAGLE_FLUSH_TIMEOUT 200
 
 
 
@@ -60,6 +127,16 @@ struct ctcp_state {
   ctcp_segment_t *send_segment;
   ctcp_config_t *config;
   linked_list_t *linked_list_unack_segment;
+  ctcp_segment_t *ack_segment;  /* Reused for every pure ACK */
+  pool_t unack_pool;            /* unacknowledged_segment_t */
+  pool_t segment_pool;          /* Header + MAX_SEG_DATA_SIZE segments */
+  rtt_estimator_t rtt;
+
+  ctcp_segment_t *pending;      /* Read data not sent yet, NULL if none */
+  uint16_t pending_len;         /* Payload bytes in pending */
+  long pending_since;           /* First held back, 0 if not held */
+  bool nodelay;                 /* Nagle off, send small segments at once */
+  long nagle_timeout;           /* Longest small data is held back, in ms */
 
   bool check_FIN_receive;
 
@@ -74,6 +151,225 @@ static ctcp_state_t *state_list;
 
 /* FIXME: Feel free to add as many helper functions as needed. Don't repeat
           code! Helper functions make the code clearer and cleaner. */
+void pool_init(pool_t *pool, size_t object_size)
+{
+  memset(pool,0,sizeof(pool_t));
+  // Every object must be able to hold the free list link
+  if (object_size < sizeof(void*))
+  {
+    object_size = sizeof(void*);
+  }
+  pool->object_size = (object_size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+}
+
+/*
+  Zeroed object from the free list, grabbing a new slab when it is empty.
+*/
+void *pool_alloc(pool_t *pool)
+{
+  pool_slab_t *slab;
+  char *object;
+  unsigned int index;
+
+  if (pool->free_list == NULL)
+  {
+    slab = (pool_slab_t*)malloc(sizeof(pool_slab_t) + POOL_SLAB_OBJECTS * pool->object_size);
+    if (slab == NULL)
+    {
+      return NULL;
+    }
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    object = (char*)(slab + 1);
+    for (index = 0; index < POOL_SLAB_OBJECTS; index++)
+    {
+      *(void**)(object + index * pool->object_size) = pool->free_list;
+      pool->free_list = object + index * pool->object_size;
+    }
+  }
+
+  object = (char*)pool->free_list;
+  pool->free_list = *(void**)object;
+  pool->in_use ++;
+  memset(object,0,pool->object_size);
+  return object;
+}
+
+void pool_free(pool_t *pool, void *object)
+{
+  if (object == NULL)
+  {
+    return;
+  }
+  *(void**)object = pool->free_list;
+  pool->free_list = object;
+  pool->in_use --;
+}
+
+void pool_destroy(pool_t *pool)
+{
+  pool_slab_t *slab;
+
+  while ((slab = pool->slabs) != NULL)
+  {
+    pool->slabs = slab->next;
+    free(slab);
+  }
+  pool->free_list = NULL;
+  pool->in_use = 0;
+}
+
+/*
+  One's complement sum kernels. Each returns the unfolded sum of the data
+  taken as 16-bit words in host byte order; by the byte order independence
+  of the Internet checksum (RFC 1071) folding that and complementing it
+  gives the same bytes as cksum() on the network order words.
+*/
+static inline uint64_t cksum_scalar(const uint8_t *data, size_t len)
+{
+  uint64_t sum = 0;
+  uint64_t word64;
+  uint32_t word32;
+  uint16_t word16;
+
+  while (len >= 8)
+  {
+    memcpy(&word64,data,sizeof(word64));
+    sum += (word64 & 0xffffffff) + (word64 >> 32);
+    data += 8;
+    len -= 8;
+  }
+  if (len >= 4)
+  {
+    memcpy(&word32,data,sizeof(word32));
+    sum += word32;
+    data += 4;
+    len -= 4;
+  }
+  if (len >= 2)
+  {
+    memcpy(&word16,data,sizeof(word16));
+    sum += word16;
+    data += 2;
+    len -= 2;
+  }
+  if (len > 0)
+  {
+    // Odd byte is the high half of a network order word. Added as a byte,
+    // a one byte store read back as a word would stall the load
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    sum += (uint32_t)data[0] << 8;
+#else
+    sum += data[0];
+#endif
+  }
+  return sum;
+}
+
+#if CKSUM_SIMD
+/* Lanes are widened to 32 bits and drained into the 64-bit sum before any
+   of them can overflow */
+#define CKSUM_SIMD_DRAIN 32768
+
+static uint64_t cksum_sse2(const uint8_t *data, size_t len)
+{
+  const __m128i zero = _mm_setzero_si128();
+  uint32_t lanes[4];
+  uint64_t sum = 0;
+  __m128i acc, block;
+  size_t count;
+
+  while (len >= 16)
+  {
+    acc = zero;
+    for (count = 0; len >= 16 && count < CKSUM_SIMD_DRAIN; count++)
+    {
+      block = _mm_loadu_si128((const __m128i*)data);
+      acc = _mm_add_epi32(acc,_mm_unpacklo_epi16(block,zero));
+      acc = _mm_add_epi32(acc,_mm_unpackhi_epi16(block,zero));
+      data += 16;
+      len -= 16;
+    }
+    _mm_storeu_si128((__m128i*)lanes,acc);
+    sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  }
+  return sum + cksum_scalar(data,len);
+}
+
+__attribute__((target("avx2")))
+static uint64_t cksum_avx2(const uint8_t *data, size_t len)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  uint32_t lanes[8];
+  uint64_t sum = 0;
+  __m256i acc, block;
+  size_t count;
+  int lane;
+
+  while (len >= 32)
+  {
+    acc = zero;
+    for (count = 0; len >= 32 && count < CKSUM_SIMD_DRAIN; count++)
+    {
+      block = _mm256_loadu_si256((const __m256i*)data);
+      acc = _mm256_add_epi32(acc,_mm256_unpacklo_epi16(block,zero));
+      acc = _mm256_add_epi32(acc,_mm256_unpackhi_epi16(block,zero));
+      data += 32;
+      len -= 32;
+    }
+    _mm256_storeu_si256((__m256i*)lanes,acc);
+    for (lane = 0; lane < 8; lane++)
+    {
+      sum += lanes[lane];
+    }
+  }
+  // Clear the upper halves first, SSE2 code after dirty 256-bit state
+  // pays a transition penalty on every instruction
+  _mm256_zeroupper();
+  return sum + cksum_sse2(data,len);
+}
+#endif
+
+/* Picked on the first call from what the CPU supports */
+static uint64_t (*cksum_kernel)(const uint8_t *data, size_t len);
+
+/* Fold a kernel's sum to 16 bits and complement it, zero as cksum() has it */
+static inline uint16_t cksum_finish(uint64_t sum)
+{
+  sum = (sum >> 32) + (sum & 0xffffffff);
+  while (sum > 0xffff)
+  {
+    sum = (sum >> 16) + (sum & 0xffff);
+  }
+  sum = (uint16_t)~sum;
+  return sum ? sum : 0xffff;
+}
+
+/*
+  Drop-in replacement for cksum(), same result bytes.
+*/
+uint16_t cksum_fast(const void *data, uint16_t len)
+{
+  if (cksum_kernel == NULL)
+  {
+    cksum_kernel = cksum_scalar;
+#if CKSUM_SIMD
+    cksum_kernel = cksum_sse2;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+      cksum_kernel = cksum_avx2;
+    }
+#endif
+  }
+
+  if (len < CKSUM_SHORT)
+  {
+    return cksum_finish(cksum_scalar((const uint8_t*)data,len));
+  }
+  return cksum_finish(cksum_kernel((const uint8_t*)data,len));
+}
+
 /*
   Funtion
   Segment in network byte order ntohl
@@ -103,18 +399,17 @@ void segment_hton(ctcp_segment_t *segment)
 
 ctcp_segment_t *generate_ACK_segment(ctcp_state_t *state)
 {
-  ctcp_segment_t * segment;
+  ctcp_segment_t * segment = state->ack_segment;
   uint16_t len_segment = sizeof(ctcp_segment_t);
-  segment = (ctcp_segment_t*)calloc(len_segment, 1);
 
   segment->seqno = state->seq_no;
   segment->ackno = state->ack_no;
   segment->len = len_segment;
-  segment->flags |= ACK;
+  segment->flags = ACK;
   segment->window = state->config->recv_window;
   segment_ntoh(segment);
   segment->cksum = 0;
-  segment->cksum = cksum(segment,len_segment);
+  segment->cksum = cksum_fast(segment,len_segment);
 
   return segment;
 }
@@ -124,7 +419,7 @@ ctcp_segment_t *generate_FIN_segment(ctcp_state_t *state)
 {
   ctcp_segment_t * segment;
   uint16_t len_segment = sizeof(ctcp_segment_t);
-  segment = (ctcp_segment_t*)calloc(len_segment, 1);
+  segment = (ctcp_segment_t*)pool_alloc(&state->segment_pool);
 
   segment->seqno = state->seq_no;
   segment->ackno = state->ack_no;
@@ -133,7 +428,7 @@ ctcp_segment_t *generate_FIN_segment(ctcp_state_t *state)
   segment->window = state->config->recv_window;
   segment_hton(segment);
   segment->cksum = 0;
-  segment->cksum = cksum(segment,len_segment);
+  segment->cksum = cksum_fast(segment,len_segment);
 
   return segment;
 
@@ -154,10 +449,8 @@ void send_FIN(ctcp_state_t *state)
 {
   ctcp_segment_t *segment_FIN = generate_FIN_segment(state);
   //segment_hton(segment_FIN);
-  if (conn_send(state->conn,segment_FIN, sizeof(ctcp_segment_t)) == -1)
-  {
-    return ;
-  }
+  conn_send(state->conn,segment_FIN, sizeof(ctcp_segment_t));
+  pool_free(&state->segment_pool,segment_FIN);
 }
 
 ctcp_segment_t *copy_segment(ctcp_segment_t * segment, uint16_t len)
@@ -175,6 +468,61 @@ ctcp_segment_t *copy_segment(ctcp_segment_t * segment, uint16_t len)
   return segment_copy;
 }
 
+void rtt_init(rtt_estimator_t *rtt, long rto, long rto_min, long rto_max)
+{
+  memset(rtt,0,sizeof(rtt_estimator_t));
+  rtt->rto_min = rto_min;
+  rtt->rto_max = rto_max;
+  rtt->rto = (rto < rto_min) ? rto_min : ((rto > rto_max) ? rto_max : rto);
+}
+
+void rtt_sample(rtt_estimator_t *rtt, long sample)
+{
+  long delta;
+
+  if (sample < 0)
+  {
+    return;
+  }
+  if (!rtt->has_sample)
+  {
+    rtt->srtt = sample << 3;
+    rtt->rttvar = sample << 1;
+    rtt->has_sample = true;
+  }
+  else
+  {
+    // SRTT += (R - SRTT) / 8, RTTVAR += (|R - SRTT| - RTTVAR) / 4
+    delta = sample - (rtt->srtt >> 3);
+    rtt->srtt += delta;
+    if (delta < 0)
+    {
+      delta = -delta;
+    }
+    rtt->rttvar += delta - (rtt->rttvar >> 2);
+  }
+
+  // RTO = SRTT + max(G, 4 * RTTVAR)
+  rtt->rto = (rtt->srtt >> 3) + ((rtt->rttvar > TIMER_INTERVAL) ? rtt->rttvar : TIMER_INTERVAL);
+  if (rtt->rto < rtt->rto_min)
+  {
+    rtt->rto = rtt->rto_min;
+  }
+  if (rtt->rto > rtt->rto_max)
+  {
+    rtt->rto = rtt->rto_max;
+  }
+}
+
+void rtt_backoff(rtt_estimator_t *rtt)
+{
+  rtt->rto <<= 1;
+  if (rtt->rto > rtt->rto_max)
+  {
+    rtt->rto = rtt->rto_max;
+  }
+}
+
 ctcp_state_t *ctcp_init(conn_t *conn, ctcp_config_t *cfg) {
   /* Connection could not be established. */
   if (conn == NULL) {
@@ -199,6 +547,12 @@ ctcp_state_t *ctcp_init(conn_t *conn, ctcp_config_t *cfg) {
   state->check_FIN_receive = false;
 
   state->linked_list_unack_segment = ll_create();
+  pool_init(&state->unack_pool,sizeof(unacknowledged_segment_t));
+  pool_init(&state->segment_pool,sizeof(ctcp_segment_t) + MAX_SEG_DATA_SIZE);
+  state->ack_segment = (ctcp_segment_t*)pool_alloc(&state->segment_pool);
+  rtt_init(&state->rtt,cfg->rt_timeout,RTO_MIN,RTO_MAX);
+  state->nodelay = NAGLE_NODELAY;
+  state->nagle_timeout = NAGLE_FLUSH_TIMEOUT;
 
   /* FIXME: Do any other initialization here. */
   return state;
@@ -212,6 +566,9 @@ void ctcp_destroy(ctcp_state_t *state) {
   *state->prev = state->next;
   conn_remove(state->conn);
   ll_destroy(state->linked_list_unack_segment);
+  // Unacked segments and the ACK segment go back with their slabs
+  pool_destroy(&state->unack_pool);
+  pool_destroy(&state->segment_pool);
 
   /* FIXME: Do any other cleanup here. */
   free(state->config);
@@ -219,68 +576,99 @@ void ctcp_destroy(ctcp_state_t *state) {
   end_client();
 }
 
-void ctcp_read(ctcp_state_t *state) {
-  /* FIXME */
-  char * buffer;
-  uint16_t buffer_len = state->config->send_window;
-  uint16_t len_segment;
+/*
+  Send the segment ctcp_read() filled, if it holds any data, and queue it
+  for retransmission.
+*/
+void send_pending(ctcp_state_t *state)
+{
+  ctcp_segment_t *segment = state->pending;
+  uint16_t data_len = state->pending_len;
+  uint16_t len_segment = sizeof(ctcp_segment_t) + data_len;
   long last_time_send_segment;
-  ctcp_segment_t *segment;
-  buffer = (char*)calloc(state->config->send_window,1);
 
-  int32_t data_len = conn_input(state->conn, buffer, buffer_len);
-  if (data_len == -1)
+  if (segment == NULL || data_len == 0)
   {
-    // send FIN
-    send_FIN(state);
-    state->seq_no = state->seq_no + 1;
+    return;
   }
-  else if (data_len == 0)
+  state->pending = NULL;
+  state->pending_len = 0;
+  state->pending_since = 0;
+
+  segment->seqno = state->seq_no;
+  segment->ackno = state->ack_no;
+  segment->len = len_segment;
+  segment->flags |= ACK;
+  segment->window = state->config->send_window;
+  segment_hton(segment);
+
+  segment->cksum = 0;
+  segment->cksum = cksum_fast(segment,len_segment);
+
+  int ret = conn_send(state->conn,segment,len_segment);
+  last_time_send_segment = current_time();
+
+  if(ret == -1)
   {
-    // 
+    pool_free(&state->segment_pool,segment);
+    return;
   }
   else
   {
-    // size_t num_chunks = buffer_size / chunk_size;
-    // size_t remaining_bytes = buffer_size % chunk_size;
+    state->seq_no += data_len;
+  }
+  unacknowledged_segment_t * unack_segment = (unacknowledged_segment_t*) pool_alloc(&state->unack_pool);
+  unack_segment->num_retransmit = 0;
+  unack_segment->last_time_send = last_time_send_segment;
+  unack_segment->segment = segment;
+  ll_add(state->linked_list_unack_segment,unack_segment);
+}
 
-    // for 
-    len_segment = sizeof(ctcp_segment_t) + data_len;
-    segment = (ctcp_segment_t*)calloc(len_segment, 1);
+void ctcp_read(ctcp_state_t *state) {
+  /* FIXME */
+  uint16_t buffer_len = state->config->send_window;
+  int32_t bytes_read = 0;
 
-    segment->seqno = state->seq_no;
-    segment->ackno = state->ack_no;
-    segment->len = len_segment;
-    segment->flags |= ACK;
-    segment->window = state->config->send_window;
-    memcpy(segment->data,buffer,data_len);
-    segment_hton(segment);
+  // conn_input() writes straight into the payload of the segment that goes
+  // on the wire, the header space is reserved in front of it
+  if (buffer_len > MAX_SEG_DATA_SIZE)
+  {
+    buffer_len = MAX_SEG_DATA_SIZE;
+  }
+  if (state->pending == NULL)
+  {
+    state->pending = (ctcp_segment_t*)pool_alloc(&state->segment_pool);
+    state->pending_len = 0;
+  }
 
-    segment->cksum = 0;
-    segment->cksum = cksum(segment,len_segment);
+  // Coalesce every read available right now into the pending segment
+  while (state->pending_len < buffer_len &&
+         (bytes_read = conn_input(state->conn,state->pending->data + state->pending_len,
+                                  buffer_len - state->pending_len)) > 0)
+  {
+    state->pending_len += bytes_read;
+  }
 
-    int ret = conn_send(state->conn,segment,len_segment);
-    last_time_send_segment = current_time();
-    //fprintf(stderr,"%ld 12\n",last_time_send_segment);
+  if (bytes_read == -1)
+  {
+    // EOF: what is held back goes first, then the FIN
+    send_pending(state);
+    send_FIN(state);
+    state->seq_no = state->seq_no + 1;
+    return;
+  }
 
-    if(ret == -1)
-    {
-      return;
-    }
-    else
+  // Nagle: hold a small segment back while data is in flight
+  if (state->pending_len < buffer_len && !state->nodelay &&
+      ll_front(state->linked_list_unack_segment) != NULL)
+  {
+    if (state->pending_len > 0 && state->pending_since == 0)
     {
-      state->seq_no += data_len;
+      state->pending_since = current_time();
     }
-    unacknowledged_segment_t * unack_segment = (unacknowledged_segment_t*) calloc(sizeof(unacknowledged_segment_t),1);
-    unack_segment->num_retransmit = 0;
-    unack_segment->last_time_send = last_time_send_segment;
-    unack_segment->segment = segment;
-    ll_add(state->linked_list_unack_segment,unack_segment);
-    
-    //free(unack_segment);
-  }
-  //free(segment);
-  free(buffer);
+    return;
+  }
+  send_pending(state);
 }
 
 void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len) {
@@ -294,8 +682,8 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len) {
   char * buffer;
   uint16_t cksum_recv;
   uint16_t data_len = len - sizeof(ctcp_segment_t);
-  buffer = (char*)calloc(state->config->recv_window,1);
-  memcpy(buffer,segment->data,data_len);
+  // Delivered straight from the received segment
+  buffer = segment->data;
 
   // Truncated
 
@@ -309,7 +697,7 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len) {
   segment_hton(segment);
   cksum_recv = segment->cksum;
   segment->cksum = 0;
-  uint16_t cksum_recv_check = cksum(segment, ntohs(segment->len));
+  uint16_t cksum_recv_check = cksum_fast(segment, ntohs(segment->len));
 
   if (cksum_recv != cksum_recv_check)
   {
@@ -330,35 +718,43 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len) {
   ll_node_t *node = ll_front(state->linked_list_unack_segment);
   if (node)
   {
-    ll_remove(state->linked_list_unack_segment,node);
+    unacknowledged_segment_t *unack_segment = ll_remove(state->linked_list_unack_segment,node);
+    // Karn's rule: no RTT sample from a retransmitted segment
+    if (unack_segment->num_retransmit == 0)
+    {
+      rtt_sample(&state->rtt,current_time() - unack_segment->last_time_send);
+    }
+    pool_free(&state->segment_pool,unack_segment->segment);
+    pool_free(&state->unack_pool,unack_segment);
+  }
+  // Nothing in flight any more, the held back data can go
+  if (ll_front(state->linked_list_unack_segment) == NULL)
+  {
+    send_pending(state);
   }
 
   if (segment->flags & FIN)
   {
-    state->ack_no = segment->seqno + 1;
-    send_ACK(state);
-    if (conn_bufspace(state->conn) > len )
-    {
-      if(conn_output(state->conn,buffer,0) == -1)
-      {
-        ctcp_destroy(state);
-        return;
-      }
-    }
-    //fprintf(stderr,"hihi");
+    state->ack_no = segment->seqno + data_len + 1;
   }
   else if (segment->flags & ACK)
   {
     state->ack_no = segment->seqno + data_len;
   }
+
+  // One ACK covers both the data and the FIN
+  if (data_len > 0 || (segment->flags & FIN))
+  {
+    send_ACK(state);
+  }
   
   if (data_len > 0)
   {
-    send_ACK(state);
     if (conn_bufspace(state->conn) > len )
     {
       if(conn_output(state->conn,buffer,data_len) == -1)
       {
+        free(segment);
         ctcp_destroy(state);
         return;
       }
@@ -366,6 +762,19 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len) {
 
   }
 
+  if (segment->flags & FIN)
+  {
+    if (conn_bufspace(state->conn) > len )
+    {
+      if(conn_output(state->conn,buffer,0) == -1)
+      {
+        free(segment);
+        ctcp_destroy(state);
+        return;
+      }
+    }
+  }
+
   if (segment->flags & FIN)
   {
     state->check_FIN_receive = true;
@@ -373,10 +782,13 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len) {
 
   if ( (segment->flags & ACK) && state->check_FIN_receive)
   {
+    free(segment);
     ctcp_destroy(state);
+    return;
   }
-  
-  //free(segment);
+
+  // buffer points into the segment, done with both
+  free(segment);
 
 }
 
@@ -429,12 +841,20 @@ void ctcp_timer() {
   {
     node = ll_front(state_current->linked_list_unack_segment);
     unacknowledged_segment_t *unack_segment_timer;
+    bool retransmitted = false;
+
+    // Flush deadline of held back data
+    if (state_current->pending_since != 0 &&
+        current_time() - state_current->pending_since >= state_current->nagle_timeout)
+    {
+      send_pending(state_current);
+    }
 
     while (node)
     {
         unack_segment_timer = (unacknowledged_segment_t*)node->object;
         //fprintf(stderr,"%ld 1 \n",current_time() - unack_segment_timer->last_time_send );
-        if ((current_time() - unack_segment_timer->last_time_send)  > state_current->config->rt_timeout)
+        if ((current_time() - unack_segment_timer->last_time_send)  > state_current->rtt.rto)
         {
           // Retransmit segment
           if (unack_segment_timer->num_retransmit >= (MAX_NUM_XMITS))
@@ -449,9 +869,16 @@ void ctcp_timer() {
           }
           unack_segment_timer->num_retransmit ++;
           unack_segment_timer->last_time_send = current_time();
+          retransmitted = true;
         }
         node = node->next;
     }
+    // Exponential backoff until a fresh RTT sample comes in, once per
+    // timeout however many segments it resent
+    if (retransmitted)
+    {
+      rtt_backoff(&state_current->rtt);
+    }
     state_current = state_current->next;
   }
   
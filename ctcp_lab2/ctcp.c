@@ -11,34 +11,480 @@
  *
  *****************************************************************************/
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE             /* CPU_SET(), pthread_setaffinity_np(), sendmmsg() */
+#endif
 #include "ctcp.h"
 #include "ctcp_linked_list.h"
 #include "ctcp_sys.h"
 #include "ctcp_utils.h"
+#include "ctcp_trace.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
 
 
 #define TEST 1
 #define TEST_DEBUG 0
 /**
- * Packet data
+ * Checksum
  *
+ * cksum_fast() computes the same Internet checksum as cksum() with a
+ * vectorized kernel: AVX2 or SSE2 on x86, chosen at run time, and a
+ * scalar loop over 64-bit words everywhere else. Data shorter than CKSUM_SHORT
+ * (headers, pure ACKs) goes straight to the scalar loop, where the call
+ * through the kernel pointer and the vector setup cost more than they
+ * save.
  */
-typedef struct packet{
-  ctcp_segment_t *segment;
-  long last_time_send;
-  uint8_t num_retransmit;
-}packet_t;
+#define CKSUM_SHORT 64
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CKSUM_SIMD 1
+#include <immintrin.h>
+#else
+#define CKSUM_SIMD 0
+#endif
+
+/**
+ * Object pool
+ *
+ * Fixed size objects carved out of POOL_SLAB_OBJECTS sized slabs and
+ * recycled through a free list, so a long transfer reuses the same memory
+ * instead of going through calloc()/free() per segment. Slabs are only
+ * returned to the system by pool_destroy(), in ctcp_destroy().
+ */
+#define POOL_SLAB_OBJECTS 64
+
+typedef struct pool_slab{
+  struct pool_slab *next;
+}pool_slab_t;
+
+typedef struct pool{
+  size_t object_size;
+  void *free_list;          /* Next free object, linked through its first word */
+  pool_slab_t *slabs;
+  unsigned int in_use;
+}pool_t;
+
+/* Segment size classes: header only (plus SACK blocks) and full segments */
+#define SEGMENT_CLASS_HEADER 0
+#define SEGMENT_CLASS_FULL 1
+#define SEGMENT_CLASSES 2
+
+/**
+ * Timer wheel
+ *
+ * Hierarchical timing wheel (Varghese & Lauck) holding deadlines such as
+ * retransmission timeouts. Level 0 has one slot per TIMER_WHEEL_TICK ms,
+ * each level above covers TIMER_WHEEL_SLOTS times the range of the one
+ * below. Arming and cancelling are O(1); ctcp_timer() only visits the slots
+ * it moves past and the entries that actually expire in them.
+ */
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_TICK 1        /* ms per level 0 slot */
+
+typedef struct timer_entry{
+  struct timer_entry *next;
+  struct timer_entry **pprev;     /* NULL when the entry is not armed */
+  long expires;                   /* Deadline, in ticks */
+  void (*expire)(struct timer_entry *entry, long now);
+  void *object;                   /* Owner passed back to expire() */
+}timer_entry_t;
+
+typedef struct timer_wheel{
+  timer_entry_t *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+  long current;                   /* Last tick processed */
+  bool initialized;
+}timer_wheel_t;
 
 /**
 * Unacknowledged segment;
 * 
+* A [seqno, seqno + data_len) range of the send ring that has been put on
+* the wire but not acknowledged yet. The payload itself stays in the ring,
+* so a retransmission can cut a different (bigger) segment out of it.
 */
 typedef struct unack_segment{
-  ctcp_segment_t *segment;
+  uint32_t seqno;
+  uint16_t data_len;
+  uint32_t flags;
   long last_time_send;
   uint8_t num_retransmit;
+  ll_node_t *node;          /* Node in linked_list_unack_segment */
+  ll_node_t link;           /* Storage for node, the list allocates nothing */
+  bool sacked;              /* Reported received by a SACK block */
+  ctcp_segment_t *wire;     /* Checksummed network order image, built on
+                               first transmission and reused for resends */
+  uint64_t first_send_us;   /* 0 until first transmitted */
+  uint64_t send_us;         /* Last transmission */
 }unack_segment_t;
 
+/**
+ * Send ring buffer
+ *
+ * Bytes returned by conn_input() are kept here, keyed by sequence number,
+ * until they are acknowledged. Byte "seqno" lives at buf[seqno & (size - 1)],
+ * so segments are cut out of the ring only when the window opens and no
+ * per-segment bookkeeping is needed for queued data.
+ */
+#define SEND_RING_SIZE (1 << 16) /* Minimum size, rounded up to a power of 2 */
+
+#define DUP_ACK_THRESHOLD 3       /* Duplicate ACKs that trigger fast retransmit */
+
+/**
+ * Selective acknowledgement
+ *
+ * Every segment of a SACK capable end carries SACK_PERMITTED. Once the
+ * peer has shown it, pure ACKs may carry SACK_OPT: their data is then a
+ * list of up to SACK_MAX_BLOCKS [start, end) seqno pairs (network order)
+ * received above the cumulative ackno, not payload.
+ */
+#define SACK_ENABLE 1
+#define SACK_PERMITTED 0x100
+#define SACK_OPT 0x200
+#define SACK_MAX_BLOCKS 4
+
+/**
+ * Delayed ACKs
+ *
+ * In order data is acknowledged once DELACK_SEGMENTS full segments are
+ * waiting or DELACK_TIMEOUT ms after the first of them, whichever comes
+ * first (RFC 1122). Out of order and duplicate segments are acknowledged
+ * at once. DELACK_SEGMENTS 0 acknowledges every segment.
+ */
+#define DELACK_SEGMENTS 2
+#define DELACK_TIMEOUT 40
+
+/**
+ * Nagle coalescing (RFC 896)
+ *
+ * While data is in flight, less than MAX_SEG_DATA_SIZE of new data stays
+ * in the send ring so that later reads can fill the segment up. It goes
+ * out when the in-flight data is acknowledged, when a full segment has
+ * queued up, or NAGLE_FLUSH_TIMEOUT ms after it was first held back.
+ * NAGLE_NODELAY (TCP_NODELAY) sends every read at once.
+ */
+#define NAGLE_NODELAY 0
+#define NAGLE_FLUSH_TIMEOUT 200
+
+/**
+ * Linger (TIME_WAIT)
+ *
+ * When we closed first, the state is kept for LINGER_TIMEOUT ms after both
+ * FINs are through, twice the maximum segment lifetime, so that a FIN the
+ * peer resends because our last ACK was lost is still acknowledged. Every
+ * resent FIN restarts the wait (RFC 793). When the peer closed first, the
+ * ACK of our FIN proves it has ours, and the state goes at once.
+ */
+#define LINGER_TIMEOUT (2 * MAX_SEG_LIFETIME_MS)
+
+/**
+ * Pacing
+ *
+ * Optional token bucket between the sliding window and the wire, so an ACK
+ * that opens the window does not release it as one line rate burst. Tokens
+ * (bytes) accrue on a microsecond clock at PACING_RATE, or when that is 0
+ * at cwnd / srtt times PACING_GAIN_SS percent in slow start and
+ * PACING_GAIN_CA percent after it. The bucket holds PACING_BURST_MIN
+ * segments or 1 ms worth of rate, whichever is more. A segment without
+ * tokens waits on the timer wheel for the ms they will be there, and
+ * ctcp_timer_next() lets the event loop wake up for that deadline instead
+ * of the next ctcp_timer() tick. Nothing is paced before the first RTT
+ * sample, nor below 1 ms of srtt.
+ */
+#define PACING_ENABLE 0
+#define PACING_RATE 0           /* Bytes/s, 0 to derive it from cwnd / srtt */
+#define PACING_GAIN_SS 200
+#define PACING_GAIN_CA 120
+#define PACING_BURST_MIN 2
+#define PACING_REPORT 0         /* Print the pacing counters in ctcp_destroy() */
+
+/**
+ * Statistics
+ *
+ * Every connection counts what it sent, resent, received and delivered,
+ * and keeps two log-linear (HDR style) histograms in us: the RTT samples
+ * fed to the estimator, and the time from a segment's first transmission
+ * to the cumulative ACK that released it, resends included. Buckets are
+ * 1/HIST_SUB of a power of 2 wide, about 3% relative error, up to 2^32 us.
+ * ctcp_stats_dump() writes every connection of the calling thread's shard
+ * and their sum as JSON. Built with STATS_SIGNAL set to a signal number
+ * (-DSTATS_SIGNAL=SIGUSR1), that signal asks for the same dump on stderr
+ * from the next ctcp_timer(); by default no handler is installed.
+ */
+#ifndef STATS_SIGNAL
+#define STATS_SIGNAL 0          /* 0 for no signal handler */
+#endif
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_SHIFTS 27
+#define HIST_BUCKETS ((HIST_SHIFTS + 1) * HIST_SUB)
+
+/**
+ * Logging and tracing
+ *
+ * CTCP_LOG() goes to stderr only for levels up to LOG_LEVEL; the others
+ * are constant false and compiled out, arguments and all. Per segment
+ * events go through TRACE() instead, into the shard's ring of
+ * TRACE_RING_SIZE binary records (clock ticks, event, seqno, ackno, len).
+ * Only the owning worker writes a ring, so a record is a few stores with
+ * no lock and no system call, and the oldest records are overwritten.
+ * ctcp_trace_dump() writes the ring to a file in the layout of
+ * ctcp_trace.h, and ctcp_trace_decode.c prints such a dump as text.
+ * Tracing is off unless built with TRACE_ENABLE=1.
+ */
+#define LOG_ERROR 1
+#define LOG_WARN 2
+#define LOG_INFO 3
+#define LOG_DEBUG 4
+#define LOG_LEVEL LOG_WARN
+
+#define CTCP_LOG(level, ...) \
+  do { if ((level) <= LOG_LEVEL) fprintf(stderr,__VA_ARGS__); } while (0)
+
+#ifndef TRACE_ENABLE
+#define TRACE_ENABLE 0
+#endif
+#define TRACE_RING_SIZE 4096    /* Records, power of 2 */
+
+typedef struct trace_ring{
+  trace_record_t records[TRACE_RING_SIZE];
+  uint64_t head;                /* Records written since the start */
+  uint64_t start_ticks;         /* Clock at the first record, for the */
+  uint64_t start_us;            /* decoder to turn ticks into time */
+}trace_ring_t;
+
+#if TRACE_ENABLE
+#define TRACE(state, event, seqno, ackno, len) \
+  trace_event(&(state)->shard->trace,(state),(event),(seqno),(ackno),(len))
+#else
+#define TRACE(state, event, seqno, ackno, len) do { } while (0)
+#endif
+
+/**
+ * Flow control
+ *
+ * The advertised window is the room left in the receive ring once the
+ * bytes the application has not taken yet (conn_bufspace() full) are
+ * counted. Its right edge never moves back and only moves forward in steps
+ * of at least min(MSS, recv_window / 2) (RFC 1122 receiver SWS avoidance);
+ * ctcp_output() sends a window update when such a step opens up.
+ * The sender keeps to the window of the last ACK and probes a zero window
+ * every persist timeout with an old seqno, which the peer has to answer
+ * with an ACK.
+ */
+#define WINDOW_MAX 0xffff       /* Largest value of the window field */
+#define RECV_WINDOW 0           /* Receive buffer in bytes, 0 for config->recv_window */
+#define SEND_WINDOW 0           /* Send buffer in bytes, 0 for config->send_window */
+
+/**
+ * Window scaling (RFC 7323)
+ *
+ * The 16-bit window field counts units of 1 << shift bytes. A scaling end
+ * sets WSCALE_OPT on every segment and puts the shift applied to that
+ * segment's window in WSCALE_SHIFT_MASK, so each window can be read on its
+ * own. It scales its own windows only once the peer has shown WSCALE_OPT;
+ * until then, and towards an end that never does, the shift is 0 and the
+ * window is capped at WINDOW_MAX bytes.
+ */
+#define WSCALE_ENABLE 1
+#define WSCALE_OPT 0x400
+#define WSCALE_SHIFT_MASK 0xf000
+#define WSCALE_SHIFT_BITS 12
+#define WSCALE_MAX 14
+
+/**
+ * Batched transmit
+ *
+ * Segments are not handed to conn_send() one by one but queued in the
+ * connection's tx_batch and flushed together at the end of the entry point
+ * that produced them (ctcp_read(), ctcp_receive(), ctcp_output(), and
+ * ctcp_timer() for every connection one tick touched). A system layer that
+ * provides conn_send_batch(), e.g. on top of sendmmsg() or UDP GSO, gets
+ * the whole burst in one call; otherwise the flush falls back to
+ * conn_send() per segment. Queued segments are sent from where they live
+ * (wire images, ack_segment), so a wire image is never dropped while queued.
+ */
+#define TX_BATCH_MAX 64
+#define TX_BATCH_REPORT 0       /* Print the batch counters in ctcp_destroy() */
+
+/* Optional, from the system layer: send "count" segments in one call,
+   returns how many went out or -1 */
+int conn_send_batch(conn_t *conn, ctcp_segment_t **segments, size_t *lens, int count)
+  __attribute__((weak));
+
+/**
+ * Batched receive
+ *
+ * A system layer reading with recvmmsg() hands the whole burst to
+ * ctcp_receive_batch() instead of calling ctcp_receive() per datagram. The
+ * buffers stay the caller's, and delivery, ACK and transmit flush run once
+ * per batch of up to RX_BATCH_MAX segments.
+ */
+#define RX_BATCH_MAX 64
+
+typedef struct send_ring{
+  char *buf;
+  uint32_t size;
+  uint32_t head_seqno;  /* Oldest unacknowledged byte */
+  uint32_t tail_seqno;  /* Next byte to be written by ctcp_read() */
+}send_ring_t;
+
+/**
+ * Receive ring buffer
+ *
+ * Received bytes are written straight to buf[seqno & (size - 1)], in order
+ * or not. ranges[] is the sorted, disjoint set of [start, end) intervals
+ * held above next_seqno, and bytes that are already held are simply
+ * written again. ranges[] lives behind buf, with room for every hole full
+ * sized segments can leave in the window; only a segment that would open
+ * one more hole than that (small segments) is dropped and resent by the
+ * peer.
+ */
+
+typedef struct recv_range{
+  uint32_t start;
+  uint32_t end;
+}recv_range_t;
+
+typedef struct recv_ring{
+  char *buf;
+  uint32_t size;
+  uint32_t read_seqno;  /* Next byte to go to conn_output() */
+  uint32_t next_seqno;  /* End of the in order data */
+  uint32_t num_ranges;
+  uint32_t max_ranges;
+  recv_range_t *ranges; /* Behind buf, same allocation */
+}recv_ring_t;
+
+/**
+ * Congestion control
+ *
+ * cc_state_t is the window state shared by every algorithm, cc_ops_t the
+ * hooks an algorithm implements. The sender never has more than
+ * min(cwnd, peer window) bytes in flight.
+ */
+typedef enum cc_type{
+  CC_NEWRENO,
+  CC_CUBIC
+}cc_type_t;
+
+#define CC_DEFAULT CC_NEWRENO   /* Algorithm picked by ctcp_init() */
+
+#define CUBIC_C 0.4             /* Scaling constant, segments / s^3 */
+#define CUBIC_BETA 0.7          /* Multiplicative decrease factor */
+
+typedef struct cc_state{
+  uint32_t cwnd;          /* Congestion window, in bytes */
+  uint32_t ssthresh;      /* Slow start threshold, in bytes */
+  uint32_t mss;
+  uint32_t bytes_acked;   /* Bytes acked since cwnd last grew in avoidance */
+
+  /* CUBIC only */
+  double w_max;           /* cwnd before the last reduction, in segments */
+  double w_est;           /* Reno-friendly window estimate, in segments */
+  double k;               /* Time to get back to w_max, in seconds */
+  double origin_point;    /* Plateau of the cubic function, in segments */
+  double growth;          /* Increment below one byte, carried to the next ACK */
+  long epoch_start;       /* Start of the current avoidance epoch, 0 if none */
+}cc_state_t;
+
+typedef struct cc_ops{
+  const char *name;
+  void (*init)(cc_state_t *cc, uint32_t mss);
+  void (*on_ack)(cc_state_t *cc, uint32_t bytes_acked, long now);
+  void (*on_loss)(cc_state_t *cc, uint32_t in_flight, long now);
+  void (*on_rto)(cc_state_t *cc, uint32_t in_flight, long now);
+}cc_ops_t;
+
+/**
+ * RTT estimator
+ *
+ * Jacobson/Karels smoothed RTT and RTT variance (RFC 6298), fed from the
+ * time between sending a segment and the ACK that covers it. srtt is kept
+ * scaled by 8 and rttvar by 4, all times are in ms. One retransmission
+ * timer per connection runs while data is outstanding: started when data
+ * goes out, restarted by every ACK of new data, and on expiry it backs
+ * off and resends the oldest segment only (RFC 6298 5.1 to 5.6).
+ */
+#define RTO_MIN 200             /* Lower clamp of the retransmission timeout */
+#define RTO_MAX 60000           /* Upper clamp, also caps the backoff */
+
+typedef struct rtt_estimator{
+  long srtt;                /* Smoothed RTT << 3 */
+  long rttvar;              /* RTT variance << 2 */
+  long rto;                 /* Current retransmission timeout */
+  long rto_min;
+  long rto_max;
+  bool has_sample;
+}rtt_estimator_t;
+
+typedef struct hist{
+  uint32_t counts[HIST_BUCKETS];
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+}hist_t;
+
+typedef struct ctcp_stats{
+  uint64_t bytes_sent;      /* Payload put on the wire, resends included */
+  uint64_t bytes_retransmitted;
+  uint64_t bytes_delivered; /* Handed to conn_output() */
+  uint64_t segments_sent;   /* Data and FIN segments, resends included */
+  uint64_t segments_retransmitted;
+  uint64_t acks_sent;       /* Pure ACKs */
+  uint64_t segments_received;
+  uint64_t duplicates;      /* Payload entirely below recv_base */
+  uint64_t out_of_order;    /* Payload starting above recv_base */
+  uint64_t cksum_failures;  /* Failed the length or checksum check */
+  uint64_t window_limited_ms; /* Data queued while the window was shut */
+  long window_limited_since;  /* 0 while the window is open */
+  hist_t rtt;               /* us */
+  hist_t ack_latency;       /* us */
+}ctcp_stats_t;
+
+typedef struct pacing{
+  bool enabled;
+  uint64_t fixed_rate;      /* Bytes/s, 0 to follow cwnd / srtt */
+  uint64_t rate;            /* Current rate in bytes/s, 0 while unpaced */
+  uint64_t tokens;          /* Bytes that may go out right now */
+  uint64_t stamp;           /* Last refill, in us */
+  timer_entry_t timer;      /* Tokens for the held segment are there */
+
+  uint64_t holds;           /* Segments that had to wait for tokens */
+  uint64_t bursts;          /* Sliding window passes that sent data */
+  uint64_t burst_segments;  /* Segments sent by those passes */
+  uint32_t burst_max;       /* Most segments sent back to back */
+}pacing_t;
+
+typedef struct tx_batch{
+  ctcp_segment_t *segments[TX_BATCH_MAX];
+  size_t lens[TX_BATCH_MAX];
+  int count;
+  struct ctcp_state *next;  /* In tx_pending while count > 0 */
+  struct ctcp_state **prev;
+
+  uint64_t batches;         /* Flushes */
+  uint64_t segments_sent;
+  uint64_t send_calls;      /* conn_send() / conn_send_batch() calls */
+  int largest;              /* Most segments in one flush */
+}tx_batch_t;
+
+typedef struct ctcp_state_send{
+  uint32_t send_base;
+  uint32_t nextseqnum;
+}ctcp_state_send_t;
+
+typedef struct ctcp_state_receive{
+  uint32_t recv_base;
+  uint32_t first_seq_recv;
+  uint32_t last_seqnum;
+}ctcp_state_receive_t;
+
 /**
  * Connection state.
  *
@@ -48,8 +494,8 @@ typedef struct unack_segment{
  * You should add to this to store other fields you might need.
  */
 struct ctcp_state {
-  struct ctcp_state *next;  /* Next in linked list */
-  struct ctcp_state **prev; /* Prev in linked list */
+  struct ctcp_state *next;  /* Next in conn_table bucket */
+  struct ctcp_state **prev; /* Prev in conn_table bucket */
 
   conn_t *conn;             /* Connection object -- needed in order to figure
                                out destination when sending */
@@ -62,41 +508,128 @@ struct ctcp_state {
                                this if this is the case for you */
   ctcp_config_t *config;
   bool check_read_EOF;
-  bool check_receive_FIN;
+  bool check_receive_FIN;   /* FIN reached in sequence, recv_base is past it */
+  bool check_output_EOF;    /* EOF handed to conn_output() */
+  bool fin_seen;            /* A FIN arrived, possibly ahead of its data */
+  uint32_t fin_seqno;
+  bool check_send_FIN;
+  bool passive_close;       /* Peer's FIN was in before ours went out */
+
+  uint8_t dup_ack_count;    /* Duplicate ACKs for send_base in a row */
+  bool in_fast_recovery;
+  bool rto_recovery;        /* Timed out, partial ACKs resend the next hole */
+  uint32_t recover;         /* nextseqnum when recovery was entered */
+
+  bool sack_enabled;        /* We send SACK_PERMITTED and SACK blocks */
+  bool peer_sack_ok;        /* Peer sent SACK_PERMITTED */
+  uint32_t sack_high;       /* Highest seqno SACKed by the peer */
+  uint32_t sack_rtx_next;   /* Holes below this were resent in this recovery */
+
+  uint8_t delack_segments;  /* Full segments per ACK, 0 to ACK every one */
+  long delack_timeout;      /* Longest an ACK is held back, in ms */
+  uint32_t delack_bytes;    /* In order bytes not acknowledged yet */
+  timer_entry_t delack_timer;
+  ctcp_segment_t *ack_segment; /* Reused for every pure ACK */
+
+  pool_t unack_pool;        /* unack_segment_t */
+  pool_t segment_pool[SEGMENT_CLASSES];
+
+  bool nodelay;             /* Nagle off, send small segments at once */
+  bool nagle_flush;         /* Flush deadline expired, send what is held */
+  long nagle_timeout;       /* Longest small data is held back, in ms */
+  timer_entry_t nagle_timer;
+
+  timer_entry_t rtx_timer;  /* Retransmission timer, armed while data is out */
+
+  uint32_t recv_window;     /* Receive buffer, bytes */
+  uint32_t send_window;     /* Send buffer, bytes */
+  bool wscale_enabled;      /* We send WSCALE_OPT */
+  bool peer_wscale_ok;      /* Peer sent WSCALE_OPT, our windows are scaled */
+  uint8_t rcv_wscale;       /* Shift of the windows we advertise */
+  uint8_t snd_wscale;       /* Shift of the last window from the peer */
+  uint32_t peer_window;     /* Window of the last acceptable ACK, bytes */
+  uint32_t adv_edge;        /* Right edge of the window we advertised */
+  long persist_timeout;     /* Zero window probe interval, backs off */
+  timer_entry_t persist_timer;
+  timer_entry_t linger_timer;/* Armed once both directions are closed */
 
-  uint32_t last_byte_read;
   uint32_t last_byte_ack;
   uint32_t last_byte_output;
 
-  linked_list_t *send_list;
-  linked_list_t *recv_list;   
+  send_ring_t send_ring;
+  cc_state_t cc;
+  const cc_ops_t *cc_ops;
+  rtt_estimator_t rtt;
+  recv_ring_t recv_ring;
+  ctcp_state_send_t send;
+  ctcp_state_receive_t receive;
+  tx_batch_t tx_batch;
+  pacing_t pacing;
+  ctcp_stats_t stats;
+  struct ctcp_shard *shard; /* Owner of the timers and tables we are in */
   linked_list_t *linked_list_unack_segment;
                        
 
   /* FIXME: Add other needed fields. */
 };
 
+/**
+ * Connection table
+ *
+ * Every connection state, hashed by its conn_t and chained through its
+ * next/prev fields, so lookup, insert and remove are O(1). The bucket
+ * array doubles whenever there are more states than buckets. Nothing walks
+ * the table per tick: ctcp_timer() only visits expired deadlines.
+ */
+#define CONN_TABLE_MIN_BUCKETS 64
 
-typedef struct ctcp_state_send{
-  uint32_t send_base;
-  uint32_t current_send;
-  uint32_t nextseqnum;
-}ctcp_state_send_t;
-
-typedef struct ctcp_state_receive{
-  uint32_t recv_base;
-  uint32_t first_seq_recv;
-  uint32_t last_seqnum;
-}ctcp_state_receive_t;
+typedef struct conn_table{
+  ctcp_state_t **buckets;
+  uint32_t num_buckets;     /* Power of 2 */
+  uint32_t num_states;
+}conn_table_t;
 
 /**
- * Linked list of connection states. Go through this in ctcp_timer() to
- * resubmit segments and tear down connections.
+ * Shards
+ *
+ * Everything the protocol keeps outside the connection states. A single
+ * threaded system layer only ever uses ctcp_shard_default. Under the
+ * sharded runtime every worker thread enters its own shard before it
+ * creates connections; a connection stays in the shard it was created in
+ * and the entry points only touch that shard, so no lock is taken on the
+ * hot path. Segment and unack pools are per connection already.
  */
-static ctcp_state_t *state_list;
+#ifndef SHARD_RUNTIME
+#define SHARD_RUNTIME 0         /* ctcp_shard_run() worker threads, needs -pthread */
+#endif
+#define SHARD_MAX_WORKERS 64
+#if SHARD_RUNTIME
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+typedef struct ctcp_shard{
+  timer_wheel_t timer_wheel;  /* Deadlines, driven by ctcp_timer() */
+  conn_table_t conn_table;
+  ctcp_state_t *tx_pending;   /* Connections with segments queued in their
+                                 tx_batch, flushed by ctcp_timer() */
+  int id;
+  int stats_seen;           /* Dump requests already served */
+#if TRACE_ENABLE
+  trace_ring_t trace;
+#endif
+}ctcp_shard_t;
+
+static ctcp_shard_t ctcp_shard_default;
 
-ctcp_state_send_t *state_send;
-ctcp_state_receive_t *state_receive;
+#if STATS_SIGNAL
+/* Bumped by the STATS_SIGNAL handler, each shard dumps once per bump */
+static volatile sig_atomic_t stats_requests;
+#endif
+static __thread ctcp_shard_t *ctcp_shard = &ctcp_shard_default;
 
 // int current_index_send = 0;
 
@@ -111,16 +644,138 @@ void segment_ntoh(ctcp_segment_t *segment);
 void segment_hton(ctcp_segment_t *segment);
 
 
+void pool_init(pool_t *pool, size_t object_size);
+void *pool_alloc(pool_t *pool);
+void pool_free(pool_t *pool, void *object);
+void pool_destroy(pool_t *pool);
+ctcp_segment_t *segment_alloc(ctcp_state_t *state, uint16_t len);
+void segment_free(ctcp_state_t *state, ctcp_segment_t *segment, uint16_t len);
+
+void send_ring_init(send_ring_t *ring, uint32_t min_size, uint32_t seqno);
+uint32_t send_ring_space(send_ring_t *ring);
+void send_ring_write(send_ring_t *ring, const char *data, uint32_t len);
+char *send_ring_write_ptr(send_ring_t *ring, uint32_t *len);
+void send_ring_commit(send_ring_t *ring, uint32_t len);
+void send_ring_copy(send_ring_t *ring, uint32_t seqno, char *dst, uint32_t len);
+void send_ring_release(send_ring_t *ring, uint32_t seqno);
+void recv_ring_init(recv_ring_t *ring, uint32_t min_size, uint32_t seqno);
+bool recv_ring_insert(recv_ring_t *ring, uint32_t seqno, const char *data, uint32_t len);
+uint32_t recv_ring_readable(recv_ring_t *ring, char **data);
+void recv_ring_consume(recv_ring_t *ring, uint32_t len);
+
+void cc_newreno_init(cc_state_t *cc, uint32_t mss);
+void cc_newreno_on_ack(cc_state_t *cc, uint32_t bytes_acked, long now);
+void cc_newreno_on_loss(cc_state_t *cc, uint32_t in_flight, long now);
+void cc_newreno_on_rto(cc_state_t *cc, uint32_t in_flight, long now);
+void cc_cubic_init(cc_state_t *cc, uint32_t mss);
+void cc_cubic_on_ack(cc_state_t *cc, uint32_t bytes_acked, long now);
+void cc_cubic_on_loss(cc_state_t *cc, uint32_t in_flight, long now);
+void cc_cubic_on_rto(cc_state_t *cc, uint32_t in_flight, long now);
+void ctcp_set_congestion_control(ctcp_state_t *state, cc_type_t type);
+void ctcp_set_windows(ctcp_state_t *state, uint32_t recv_window, uint32_t send_window);
+
+void rtt_init(rtt_estimator_t *rtt, long rto, long rto_min, long rto_max);
+void rtt_sample(rtt_estimator_t *rtt, long sample);
+void rtt_backoff(rtt_estimator_t *rtt);
+
+uint32_t ctcp_send_window(ctcp_state_t *state);
+uint16_t ctcp_advertised_window(ctcp_state_t *state);
+uint32_t ctcp_recv_window_limit(ctcp_state_t *state);
+uint32_t ctcp_wscale_flags(ctcp_state_t *state);
+void ctcp_persist_timeout(timer_entry_t *entry, long now);
+uint64_t ctcp_clock_us(void);
+void ctcp_pacing_update(ctcp_state_t *state);
+bool ctcp_pacing_admit(ctcp_state_t *state, uint32_t len);
+void ctcp_pacing_timeout(timer_entry_t *entry, long now);
+long ctcp_timer_next(void);
+void hist_record(hist_t *hist, uint64_t value);
+void hist_merge(hist_t *into, const hist_t *from);
+uint64_t hist_value_at(const hist_t *hist, double percentile);
+void ctcp_stats_add(ctcp_stats_t *total, const ctcp_stats_t *stats);
+void ctcp_stats_print(FILE *out, const ctcp_stats_t *stats);
+void ctcp_stats_dump(FILE *out);
+void ctcp_stats_signal_init(void);
+void ctcp_trace_dump(FILE *out);
+#if TRACE_ENABLE
+static inline void trace_event(trace_ring_t *ring, const void *state, uint16_t event,
+                               uint32_t seqno, uint32_t ackno, uint32_t len);
+#endif
+static inline uint64_t trace_clock(void);
+void ctcp_tx_queue(ctcp_state_t *state, ctcp_segment_t *segment, size_t len);
+void ctcp_tx_flush(ctcp_state_t *state);
+void ctcp_tx_flush_all(void);
+void conn_table_insert(conn_table_t *table, ctcp_state_t *state);
+void conn_table_remove(conn_table_t *table, ctcp_state_t *state);
+ctcp_state_t *conn_table_lookup(conn_table_t *table, conn_t *conn);
+void timer_wheel_init(timer_wheel_t *wheel, long now);
+void timer_wheel_add(timer_wheel_t *wheel, timer_entry_t *entry, long expires);
+void timer_wheel_cancel(timer_entry_t *entry);
+void timer_wheel_advance(timer_wheel_t *wheel, long now);
+static void timer_wheel_insert(timer_wheel_t *wheel, timer_entry_t *entry);
+
 void ctcp_send_sliding_window(ctcp_state_t *state);
-ctcp_segment_t *generate_data_segment(ctcp_state_t *state, ctcp_segment_t *segment);
-void ctcp_send_segment(ctcp_state_t *state,packet_t *packet);
-void ctcp_send_ACK(ctcp_state_t* state,packet_t* packet);
-int32_t check_continuous_in_recvlist(linked_list_t *list,packet_t *packet);
-void add_packet_in_order(linked_list_t *list, packet_t *packet);
-void add_list_unacksegment(linked_list_t *list,packet_t *packet);
-void remove_packet_in_unacksegment(linked_list_t *list,packet_t *packet_search);
+void ctcp_nagle_timeout(timer_entry_t *entry, long now);
+ctcp_segment_t *generate_data_segment(ctcp_state_t *state, unack_segment_t *unack);
+void ctcp_refresh_segment(ctcp_state_t *state, ctcp_segment_t *segment);
+void ctcp_drop_wire_segment(ctcp_state_t *state, unack_segment_t *unack);
+uint16_t cksum_update(uint16_t cksum_old, const void *old, const void *new, uint16_t len);
+uint16_t cksum_fast(const void *data, uint16_t len);
+void ctcp_send_segment(ctcp_state_t *state,unack_segment_t *unack);
+void ctcp_retransmit_segment(ctcp_state_t *state, ll_node_t *node, long now);
+void ctcp_arm_retransmit(ctcp_state_t *state);
+void ctcp_restart_retransmit(ctcp_state_t *state);
+void ctcp_retransmit_timeout(timer_entry_t *entry, long now);
+void free_unack_segment(ctcp_state_t *state, unack_segment_t *unack);
+void ctcp_fast_retransmit(ctcp_state_t *state);
+void ctcp_release_acked_segments(ctcp_state_t *state, uint32_t ackno);
+void ctcp_handle_ack(ctcp_state_t *state, ctcp_segment_t *segment, uint16_t data_len);
+void ctcp_handle_sack(ctcp_state_t *state, ctcp_segment_t *segment, uint16_t sack_len);
+void ctcp_sack_retransmit_hole(ctcp_state_t *state);
+uint16_t ctcp_build_sack_blocks(ctcp_state_t *state, ctcp_segment_t *segment, uint32_t *blocks);
+void ctcp_send_ACK(ctcp_state_t* state,ctcp_segment_t* segment);
+void ctcp_send_pure_ACK(ctcp_state_t* state,ctcp_segment_t* segment_recv,uint32_t seqno);
+void ctcp_delay_ACK(ctcp_state_t *state, uint32_t data_len);
+void ctcp_delack_timeout(timer_entry_t *entry, long now);
+void ctcp_linger_timeout(timer_entry_t *entry, long now);
+void ctcp_clear_delayed_ACK(ctcp_state_t *state);
+void ctcp_receive_batch(ctcp_state_t *state, ctcp_segment_t **segments, size_t *lens, int count);
+static bool ctcp_receive_chunk(ctcp_state_t *state, ctcp_segment_t **segments, size_t *lens,
+                               int count);
+bool ctcp_segment_check(ctcp_state_t *state, ctcp_segment_t *segment, size_t len);
+bool ctcp_process_segment(ctcp_state_t *state, ctcp_segment_t *segment, ctcp_segment_t **sack_hint);
+bool ctcp_receive_data(ctcp_state_t *state, ctcp_segment_t *segment, uint16_t data_len,
+                       ctcp_segment_t **sack_hint);
+void ctcp_receive_done(ctcp_state_t *state, uint32_t next_seqno, bool ack_now,
+                       ctcp_segment_t *sack_hint);
+void ctcp_deliver(ctcp_state_t *state);
+bool ctcp_check_teardown(ctcp_state_t *state);
+void add_list_unacksegment(ctcp_state_t *state,unack_segment_t *unack);
+unack_segment_t *remove_list_unacksegment(ctcp_state_t *state, ll_node_t *node);
+ctcp_shard_t *ctcp_shard_create(int id);
+void ctcp_shard_destroy(ctcp_shard_t *shard);
+void ctcp_shard_enter(ctcp_shard_t *shard);
+#if SHARD_RUNTIME
+int ctcp_shard_socket(uint16_t port);
+int ctcp_shard_run(int workers, void (*run)(int id, void *arg), void *arg);
+#endif
 
 
+static const cc_ops_t cc_newreno_ops = {
+  "newreno",
+  cc_newreno_init,
+  cc_newreno_on_ack,
+  cc_newreno_on_loss,
+  cc_newreno_on_rto
+};
+
+static const cc_ops_t cc_cubic_ops = {
+  "cubic",
+  cc_cubic_init,
+  cc_cubic_on_ack,
+  cc_cubic_on_loss,
+  cc_cubic_on_rto
+};
+
 ctcp_state_t *ctcp_init(conn_t *conn, ctcp_config_t *cfg) {
   /* Connection could not be established. */
   if (conn == NULL) {
@@ -130,33 +785,61 @@ ctcp_state_t *ctcp_init(conn_t *conn, ctcp_config_t *cfg) {
   /* Established a connection. Create a new state and update the linked list
      of connection states. */
   ctcp_state_t *state = calloc(sizeof(ctcp_state_t), 1);
-  state->next = state_list;
-  state->prev = &state_list;
-  if (state_list)
-    state_list->prev = &state->next;
-  state_list = state;
 
   /* Set fields. */
   state->conn = conn;
+  state->shard = ctcp_shard;
+  conn_table_insert(&state->shard->conn_table,state);
+  if (!state->shard->timer_wheel.initialized)
+  {
+    timer_wheel_init(&state->shard->timer_wheel,current_time());
+    ctcp_stats_signal_init();
+  }
 
-  //state->last_byte_read = 0;
   state->last_byte_output = 0;
   state->last_byte_ack = 0;
 
   state->config = cfg;
-  state->last_byte_read = 1;
-
-  state->send_list = ll_create();
-  state->recv_list = ll_create();
-  state->linked_list_unack_segment = ll_create();
 
+  pool_init(&state->unack_pool,sizeof(unack_segment_t));
+  pool_init(&state->segment_pool[SEGMENT_CLASS_HEADER],
+            sizeof(ctcp_segment_t) + SACK_MAX_BLOCKS * 2 * sizeof(uint32_t));
+  pool_init(&state->segment_pool[SEGMENT_CLASS_FULL],
+            sizeof(ctcp_segment_t) + MAX_SEG_DATA_SIZE);
 
-  state_send = (ctcp_state_send_t*)calloc(sizeof(ctcp_state_send_t),1);
-  state_receive = (ctcp_state_receive_t*)calloc(sizeof(ctcp_state_receive_t),1);
-
-  state_send->send_base = 1;
-  state_send->current_send = 0;
-  state_receive->recv_base = 1;
+  state->linked_list_unack_segment = ll_create();
+  state->wscale_enabled = WSCALE_ENABLE;
+  ctcp_set_windows(state,RECV_WINDOW ? RECV_WINDOW : cfg->recv_window,
+                   SEND_WINDOW ? SEND_WINDOW : cfg->send_window);
+  ctcp_set_congestion_control(state,CC_DEFAULT);
+  rtt_init(&state->rtt,cfg->rt_timeout,RTO_MIN,RTO_MAX);
+  state->sack_enabled = SACK_ENABLE;
+  state->delack_segments = DELACK_SEGMENTS;
+  state->delack_timeout = DELACK_TIMEOUT;
+  state->delack_timer.expire = ctcp_delack_timeout;
+  state->delack_timer.object = state;
+  state->ack_segment = segment_alloc(state,sizeof(ctcp_segment_t));
+  state->nodelay = NAGLE_NODELAY;
+  state->nagle_timeout = NAGLE_FLUSH_TIMEOUT;
+  state->nagle_timer.expire = ctcp_nagle_timeout;
+  state->nagle_timer.object = state;
+  // Nothing is known about the peer's buffer before its first ACK
+  state->peer_window = MAX_SEG_DATA_SIZE;
+  state->adv_edge = 1;
+  state->persist_timer.expire = ctcp_persist_timeout;
+  state->persist_timer.object = state;
+  state->linger_timer.expire = ctcp_linger_timeout;
+  state->linger_timer.object = state;
+  state->rtx_timer.expire = ctcp_retransmit_timeout;
+  state->rtx_timer.object = state;
+  state->pacing.enabled = PACING_ENABLE;
+  state->pacing.fixed_rate = PACING_RATE;
+  state->pacing.timer.expire = ctcp_pacing_timeout;
+  state->pacing.timer.object = state;
+
+  state->send.send_base = 1;
+  state->send.nextseqnum = 1;
+  state->receive.recv_base = 1;
 
   /* FIXME: Do any other initialization here. */
 
@@ -165,13 +848,49 @@ ctcp_state_t *ctcp_init(conn_t *conn, ctcp_config_t *cfg) {
 
 void ctcp_destroy(ctcp_state_t *state) {
   /* Update linked list. */
-  if (state->next)
-    state->next->prev = state->prev;
-
-  *state->prev = state->next;
+  conn_table_remove(&state->shard->conn_table,state);
+  // Whatever is still queued is dropped with the connection
+  if (state->tx_batch.count > 0)
+  {
+    state->tx_batch.count = 0;
+    if (state->tx_batch.next)
+      state->tx_batch.next->tx_batch.prev = state->tx_batch.prev;
+    *state->tx_batch.prev = state->tx_batch.next;
+  }
+#if TX_BATCH_REPORT
+  fprintf(stderr,"tx batches %llu segments %llu send calls %llu largest %d\n",
+          (unsigned long long)state->tx_batch.batches,
+          (unsigned long long)state->tx_batch.segments_sent,
+          (unsigned long long)state->tx_batch.send_calls,state->tx_batch.largest);
+#endif
+#if PACING_REPORT
+  fprintf(stderr,"pacing rate %llu B/s holds %llu bursts %llu segments %llu largest %u\n",
+          (unsigned long long)state->pacing.rate,(unsigned long long)state->pacing.holds,
+          (unsigned long long)state->pacing.bursts,
+          (unsigned long long)state->pacing.burst_segments,state->pacing.burst_max);
+#endif
   conn_remove(state->conn);
 
   /* FIXME: Do any other cleanup here. */
+  ll_node_t *node;
+  while ((node = ll_front(state->linked_list_unack_segment)) != NULL)
+  {
+    free_unack_segment(state,remove_list_unacksegment(state,node));
+  }
+  ll_destroy(state->linked_list_unack_segment);
+  free(state->send_ring.buf);
+  free(state->recv_ring.buf);
+  timer_wheel_cancel(&state->delack_timer);
+  timer_wheel_cancel(&state->nagle_timer);
+  timer_wheel_cancel(&state->persist_timer);
+  timer_wheel_cancel(&state->pacing.timer);
+  timer_wheel_cancel(&state->linger_timer);
+  timer_wheel_cancel(&state->rtx_timer);
+
+  // Everything still held by the connection goes back with its slabs
+  pool_destroy(&state->unack_pool);
+  pool_destroy(&state->segment_pool[SEGMENT_CLASS_HEADER]);
+  pool_destroy(&state->segment_pool[SEGMENT_CLASS_FULL]);
 
   free(state);
   end_client();
@@ -179,41 +898,32 @@ void ctcp_destroy(ctcp_state_t *state) {
 
 #if TEST
 void ctcp_read(ctcp_state_t *state) {
-  /* FIXME */
-  char *buffer = NULL;
-  buffer = (char*)calloc(MAX_SEG_DATA_SIZE,1);
-  uint32_t last_byte_segment_read = 1;
-  int bytes_read = 0;  
-  if (buffer == NULL)
+  char *buffer;
+  uint32_t space;
+  int bytes_read = 0;
+
+  if (state->check_read_EOF)
   {
     return;
   }
-  packet_t *packet_data;
-  while ((bytes_read = conn_input(state->conn,buffer,MAX_SEG_DATA_SIZE)) > 0 )
+  // conn_input() writes straight into the free part of the send ring, the
+  // only copy left is ring to wire when the segment is cut
+  while ((buffer = send_ring_write_ptr(&state->send_ring,&space)) != NULL)
   {
-    packet_data = (packet_t*)calloc(sizeof(packet_t),1);
-    packet_data->segment = (ctcp_segment_t*)calloc(sizeof(ctcp_segment_t) + bytes_read,1);
-
-    packet_data->num_retransmit = 0;
-    packet_data->last_time_send = current_time();
-    packet_data->segment->seqno = state->last_byte_read;
-    packet_data->segment->len = sizeof(ctcp_segment_t) + bytes_read; 
-    memcpy(packet_data->segment->data,buffer,bytes_read);
-    state->last_byte_read += bytes_read;
-    ll_add(state->send_list,packet_data);
+    bytes_read = conn_input(state->conn,buffer,space);
+    if (bytes_read <= 0)
+    {
+      break;
+    }
+    send_ring_commit(&state->send_ring,bytes_read);
   }
   if (bytes_read == -1)
   {
-    // read EOF
+    // read EOF, FIN goes out once the ring is drained
     state->check_read_EOF = true;
-    packet_data->num_retransmit = 0;
-    packet_data->last_time_send = current_time();
-    packet_data->segment->seqno  = last_byte_segment_read;
-    packet_data->segment->len = sizeof(ctcp_segment_t);
-    //last_byte_segment_read += 1;
-    ll_add(state->send_list,packet_data);
   }
   ctcp_send_sliding_window(state);
+  ctcp_tx_flush(state);
 }
 #endif
 
@@ -228,7 +938,6 @@ void ctcp_read(ctcp_state_t *state) {
   {
     return;
   }
-  packet_t *packet_data;
   int index = 0;
   for (index = 0;index < 3;index ++)
   {
@@ -242,23 +951,11 @@ void ctcp_read(ctcp_state_t *state) {
     bytes_read = strlen(buffer) + 1;
 
   
-    packet_data = (packet_t*)calloc(sizeof(packet_t),1);
-    packet_data->segment = (ctcp_segment_t*)calloc(sizeof(ctcp_segment_t) + bytes_read,1);
-
-    packet_data->num_retransmit = 0;
-    packet_data->last_time_send = current_time();
-    packet_data->segment->seqno = state->last_byte_read;
-    fprintf(stderr,"%d\n",state->last_byte_read);
-    packet_data->segment->len = sizeof(ctcp_segment_t) + bytes_read; 
-    memcpy(packet_data->segment->data,buffer,bytes_read);
-    state->last_byte_read += bytes_read;
-    ll_add(state->send_list,packet_data);
-    //add_list_unacksegment(linked_list_unack_segment,packet_data);
+    CTCP_LOG(LOG_DEBUG,"%d\n",state->send_ring.tail_seqno);
+    send_ring_write(&state->send_ring,buffer,bytes_read);
     //sleep(2);
   }
-  //int index;
-  //ll_node_t *node ;
-  fprintf(stderr,"%d\n",ll_length(state->send_list));
+  CTCP_LOG(LOG_DEBUG,"%d\n",state->send_ring.tail_seqno - state->send_ring.head_seqno);
   // if (bytes_read == -1)
   // {
   //   // read EOF
@@ -276,445 +973,2882 @@ void ctcp_read(ctcp_state_t *state) {
 }
 #endif
 
-void ctcp_send_sliding_window(ctcp_state_t *state)
+/*
+  Bytes the sender may have in flight: min(cwnd, peer window).
+*/
+uint32_t ctcp_send_window(ctcp_state_t *state)
 {
-  unsigned int index = 0;
-  unsigned int len_of_sendlist = ll_length(state->send_list);
-  uint32_t last_seqno_segment_send;
-  uint32_t last_seqno_window;
-  uint16_t data_len;
-  // ctcp_segment_t *segment;
-  packet_t *packet;
-  ll_node_t *node;
-  //ll_node_t *temp;
+  uint32_t window = state->peer_window;
 
-  if (len_of_sendlist == 0)
+  if (state->cc.cwnd < window)
   {
-    return;
+    window = state->cc.cwnd;
   }
-  
-  node = ll_front(state->send_list);
-  for (index = 0; index < state_send->current_send; index ++)
+  return window;
+}
+
+/*
+  Largest window we can advertise: the receive buffer, capped by what the
+  window field holds at the current shift.
+*/
+uint32_t ctcp_recv_window_limit(ctcp_state_t *state)
+{
+  uint8_t shift = state->peer_wscale_ok ? state->rcv_wscale : 0;
+
+  if (state->recv_window > ((uint32_t)WINDOW_MAX << shift))
   {
-    node = node->next;
+    return (uint32_t)WINDOW_MAX << shift;
   }
+  return state->recv_window;
+}
 
-  for (index = state_send->current_send ; index < len_of_sendlist; index++)
+/*
+  WSCALE_OPT and the shift of the windows we send, 0 when scaling is off.
+*/
+uint32_t ctcp_wscale_flags(ctcp_state_t *state)
+{
+  if (!state->wscale_enabled)
   {
-    packet = (packet_t*)node->object;
-
-    data_len = packet->segment->len - sizeof(ctcp_segment_t);
-    last_seqno_segment_send = packet->segment->seqno + data_len + 1;
-    last_seqno_window = state->last_byte_output + state->config->recv_window;
-
-    if (last_seqno_segment_send >= last_seqno_window)
-    {
-      return;
-    }
-
-    ctcp_send_segment(state,packet);
-    add_list_unacksegment(state->linked_list_unack_segment,packet);
-
-    //sleep(1);
-
-    //state->last_byte_read = packet->segment->seqno;
-    state->last_byte_ack = 1;
+    return 0;
+  }
+  if (!state->peer_wscale_ok)
+  {
+    return WSCALE_OPT;
+  }
+  return WSCALE_OPT | ((uint32_t)state->rcv_wscale << WSCALE_SHIFT_BITS);
+}
 
-    state_send->nextseqnum = packet->segment->seqno; 
-    
-    //temp = node;
-    node = node->next;
-    fprintf(stderr,"+%d\n",index);
-    //ll_remove(state->send_list,temp);
+/*
+  Window field of an outgoing segment, see "Flow control" above. Moves
+  adv_edge.
+*/
+uint16_t ctcp_advertised_window(ctcp_state_t *state)
+{
+  recv_ring_t *ring = &state->recv_ring;
+  uint32_t limit = ctcp_recv_window_limit(state);
+  uint32_t held = ring->next_seqno - ring->read_seqno;
+  uint32_t step = MAX_SEG_DATA_SIZE;
+  uint8_t shift = state->peer_wscale_ok ? state->rcv_wscale : 0;
+  uint32_t edge;
+  uint32_t window;
+
+  if (step > limit / 2)
+  {
+    step = limit / 2;
+  }
+  edge = ring->next_seqno + ((held < limit) ? limit - held : 0);
 
+  // Never shrink, and open in steps of at least "step"
+  if ((int32_t)(edge - state->adv_edge) < (int32_t)step)
+  {
+    edge = state->adv_edge;
   }
-  state_send->current_send = index;
-  
+  if ((int32_t)(edge - ring->next_seqno) < 0)
+  {
+    edge = ring->next_seqno;
+  }
+  // The field only holds whole units, the edge moves by what it says
+  window = (edge - ring->next_seqno) >> shift;
+  if (window > WINDOW_MAX)
+  {
+    window = WINDOW_MAX;
+  }
+  state->adv_edge = ring->next_seqno + (window << shift);
+  return (uint16_t)window;
 }
 
-ctcp_segment_t *generate_data_segment(ctcp_state_t *state, ctcp_segment_t *segment)
+/*
+  Peer window still shut: send a probe with an already acknowledged seqno
+  and back off.
+*/
+void ctcp_persist_timeout(timer_entry_t *entry, long now)
 {
-  ctcp_segment_t * data_segment;
-  uint16_t data_len = segment->len - sizeof(ctcp_segment_t);
-  uint16_t len_segment = sizeof(ctcp_segment_t) + data_len;
-  data_segment = (ctcp_segment_t*)calloc(len_segment, 1);
-
-  data_segment->seqno = segment->seqno;
-  data_segment->ackno = segment->ackno;
-  data_segment->len = len_segment;
-  data_segment->flags |= ACK;
-  data_segment->window = state->config->recv_window;
-  memcpy(data_segment->data,segment->data,data_len);
-  segment_hton(data_segment);
-  data_segment->cksum = 0;
-  data_segment->cksum = cksum(data_segment,len_segment);
+  ctcp_state_t *state = (ctcp_state_t*)entry->object;
 
-  return data_segment;
+  if (state->send.nextseqnum != state->send.send_base ||
+      state->send_ring.tail_seqno == state->send.nextseqnum)
+  {
+    return;
+  }
+  ctcp_send_pure_ACK(state,NULL,state->send.nextseqnum - 1);
+  state->persist_timeout <<= 1;
+  if (state->persist_timeout > state->rtt.rto_max)
+  {
+    state->persist_timeout = state->rtt.rto_max;
+  }
+  timer_wheel_add(&state->shard->timer_wheel,entry,now + state->persist_timeout);
 }
 
-void ctcp_send_segment(ctcp_state_t *state,packet_t *packet)
+/*
+  Monotonic clock in us for the pacing token bucket, current_time() only
+  has ms.
+*/
+uint64_t ctcp_clock_us(void)
 {
-  ctcp_segment_t * data_segment = generate_data_segment(state,packet->segment);
-  conn_send(state->conn,data_segment,ntohs(data_segment->len));
+  struct timespec now;
 
+  clock_gettime(CLOCK_MONOTONIC,&now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
 }
 
-void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len) {
-  uint16_t data_len;
-  packet_t *packet_recv;
-  uint16_t checksum_check;
-  uint16_t checksum_recv;
-  uint32_t seqno;
-  ll_node_t *temp;
-  packet_t *packet;
+/* Pacing rate for the window we are about to send from */
+void ctcp_pacing_update(ctcp_state_t *state)
+{
+  pacing_t *pacing = &state->pacing;
+  uint64_t gain;
 
-  //segment_ntoh(segment);
-  if (len < ntohs(segment->len))
+  if (!pacing->enabled)
   {
-    free(segment);
     return;
   }
-
-  checksum_recv = segment->cksum;
-  segment->cksum = 0;
-  checksum_check = cksum(segment,ntohs(segment->len));
-  fprintf(stderr,"check sum %d : %d\n",checksum_recv,checksum_check);
-  if (checksum_recv != checksum_check)
+  if (pacing->fixed_rate)
   {
-    fprintf(stderr,"corrupt\n");
-    free(segment);
+    pacing->rate = pacing->fixed_rate;
+    return;
+  }
+  // srtt is kept in 1/8 ms
+  if (!state->rtt.has_sample || state->rtt.srtt < 8)
+  {
+    pacing->rate = 0;
     return;
   }
+  gain = (state->cc.cwnd < state->cc.ssthresh) ? PACING_GAIN_SS : PACING_GAIN_CA;
+  pacing->rate = (uint64_t)state->cc.cwnd * 8000 * gain / 100 / state->rtt.srtt;
+}
 
-  segment_ntoh(segment);
-  ll_node_t *node = ll_front(state->recv_list);
-  unsigned int len_of_recvlist = ll_length(state->recv_list);
+/*
+  Take "len" bytes of tokens for the next segment. Without enough of them
+  the segment stays in the ring and the pacing timer is armed for the ms
+  the bucket will have refilled.
+*/
+bool ctcp_pacing_admit(ctcp_state_t *state, uint32_t len)
+{
+  pacing_t *pacing = &state->pacing;
+  uint64_t now, burst, wait_us;
 
-  data_len = len - sizeof(ctcp_segment_t);
-  if (segment != NULL)
+  if (!pacing->enabled || pacing->rate == 0)
+  {
+    return true;
+  }
+  burst = pacing->rate / 1000;
+  if (burst < PACING_BURST_MIN * MAX_SEG_DATA_SIZE)
   {
-    fprintf(stderr,"segment\n");
-    data_len = len - sizeof(ctcp_segment_t);
-    packet_recv = (packet_t*)calloc(sizeof(packet_t),1);
-    packet_recv->segment = (ctcp_segment_t*)calloc(sizeof(ctcp_segment_t) + data_len,1);
+    burst = PACING_BURST_MIN * MAX_SEG_DATA_SIZE;
+  }
 
-    packet_recv->segment->seqno = segment->seqno;
-    packet_recv->segment->len = segment->len; 
-    memcpy(packet_recv->segment->data,segment->data,data_len);
-    fprintf(stderr,"seqno %d\n",packet_recv->segment->seqno);
+  now = ctcp_clock_us();
+  if (now - pacing->stamp >= 1000000)
+  {
+    pacing->tokens = burst;
+  }
+  else
+  {
+    pacing->tokens += (now - pacing->stamp) * pacing->rate / 1000000;
+  }
+  if (pacing->tokens > burst)
+  {
+    pacing->tokens = burst;
+  }
+  pacing->stamp = now;
 
-    if (segment->flags & ACK)
-    {
-      state->last_byte_ack += data_len;
-      state_receive->last_seqnum += data_len;   
-    }
+  if (pacing->tokens >= len)
+  {
+    pacing->tokens -= len;
+    return true;
+  }
+  pacing->holds ++;
+  TRACE(state,TRACE_PACING_HOLD,state->send.nextseqnum,pacing->tokens,len);
+  if (pacing->timer.pprev == NULL)
+  {
+    wait_us = (len - pacing->tokens) * 1000000 / pacing->rate;
+    timer_wheel_add(&state->shard->timer_wheel,&pacing->timer,
+                    current_time() + (long)((wait_us + 999) / 1000));
+  }
+  return false;
+}
 
-    if (segment->flags & FIN)
-    {
-      state->last_byte_ack += 1;
-    }
-    if (data_len > 0)
-    {
-      if (segment->seqno > state_receive->recv_base )
-      {
-        fprintf(stderr,"err\n");
-        //ll_add(state->recv_list,packet_recv);
-        add_packet_in_order(state->recv_list,packet_recv);
-        packet_recv->segment->ackno = state->last_byte_ack;
-        ctcp_send_ACK(state,packet_recv);
-        remove_packet_in_unacksegment(state->linked_list_unack_segment,packet_recv);
-      }
-      else if (segment->seqno == state_receive->recv_base)
-      {
-        if (len_of_recvlist == 0)
-        {
-          data_len = segment->len - sizeof(ctcp_segment_t);
-          conn_output(state->conn,segment->data,data_len);
-          fprintf(stderr," %d : %d\n",segment->seqno,state_receive->recv_base);
-
-          state_receive->recv_base += data_len;
-          packet_recv->segment->ackno = state->last_byte_ack;
-          ctcp_send_ACK(state,packet_recv);
-
-          remove_packet_in_unacksegment(state->linked_list_unack_segment,packet_recv);
-          fprintf(stderr,"1\n");
-          temp = node;
-          //node = node->next;
-          //ll_remove(state->recv_list,temp);
-        }
-        else
-        {
-          fprintf(stderr,"2\n");
-          packet = (packet_t*)node->object;
-          seqno = check_continuous_in_recvlist(state->recv_list,packet);
-          if (seqno == -1)
-          {
-            fprintf(stderr,"seq = -1\n");
-            return;
-          }
-          while(packet_recv->segment->seqno <= seqno)
-          {
-            data_len = packet_recv->segment->len - sizeof(ctcp_segment_t);
-            conn_output(state->conn,packet_recv->segment->data,data_len);
-            state_receive->recv_base += data_len;
-
-            temp = node;
-            node = node->next;
-            ll_remove(state->recv_list,temp); 
-          }
-        }
-      }
-      else if (segment->seqno < state_receive->recv_base)
-      {
-        fprintf(stderr," %d < %d\n",segment->seqno,state_receive->recv_base);
-      }
-    }
-
-    //ctcp_output(state);
+/*
+  Tokens for the held segment have come in, send what the window allows.
+*/
+void ctcp_pacing_timeout(timer_entry_t *entry, long now)
+{
+  ctcp_state_t *state = (ctcp_state_t*)entry->object;
 
-    //conn_output(state->conn,segment->data,data_len);
-    //free(segment);
-  }
-  free(segment);
+  (void)now;
+  ctcp_send_sliding_window(state);
 }
 
-void ctcp_output(ctcp_state_t *state) {
-  /* FIXME */
-  // In order bytes, should conn_output()
-  //int index = 0;
-  uint16_t data_len;
-  uint32_t seqno;
-  ll_node_t *temp;
-  unsigned int len_of_recvlist = ll_length(state->recv_list);
-  ll_node_t *node = ll_front(state->recv_list);
-  packet_t *packet;
-  do{
-    packet = (packet_t*)node->object;
-    if (packet->segment->seqno > state_receive->recv_base )
-    {
-      fprintf(stderr,"11\n");
-      return;
-    }
-    else
+void ctcp_send_sliding_window(ctcp_state_t *state)
+{
+  send_ring_t *ring = &state->send_ring;
+  uint32_t last_seqno_window = state->send.send_base + ctcp_send_window(state);
+  uint32_t data_len;
+  uint32_t burst = 0;
+  bool held = false;
+  unack_segment_t *unack;
+
+  ctcp_pacing_update(state);
+  // Cut segments out of the ring while the window is open, O(1) per segment
+  while ((int32_t)(ring->tail_seqno - state->send.nextseqnum) > 0)
+  {
+    if ((int32_t)(last_seqno_window - state->send.nextseqnum) <= 0)
     {
-      if (len_of_recvlist == 1)
+      // Shut by the peer with nothing in flight to bring an ACK: probe
+      if (state->send.nextseqnum == state->send.send_base &&
+          state->persist_timer.pprev == NULL)
       {
-        data_len = packet->segment->len - sizeof(ctcp_segment_t);
-        conn_output(state->conn,packet->segment->data,data_len);
-        state_receive->recv_base += data_len;
-        packet->segment->ackno = state_receive->recv_base;
-        fprintf(stderr,"1\n");
-
-        ctcp_send_ACK(state,packet);
-        temp = node;
-        //node = node->next;
-        ll_remove(state->recv_list,temp);
+        state->persist_timeout = state->rtt.rto;
+        timer_wheel_add(&state->shard->timer_wheel,&state->persist_timer,current_time() + state->persist_timeout);
       }
-      else
+      if (state->stats.window_limited_since == 0)
       {
-        fprintf(stderr,"2\n");
-
-        seqno = check_continuous_in_recvlist(state->recv_list,packet);
-        if (seqno == -1)
-        {
-          fprintf(stderr,"seq = -1\n");
-          return;
-        }
-        while(packet->segment->seqno <= seqno)
-        {
-          data_len = packet->segment->len - sizeof(ctcp_segment_t);
-          conn_output(state->conn,packet->segment->data,data_len);
-          state_receive->recv_base += data_len;
-
-          temp = node;
-          node = node->next;
-          ll_remove(state->recv_list,temp); 
-        }
-
+        TRACE(state,TRACE_WINDOW_SHUT,state->send.nextseqnum,state->send.send_base,
+              last_seqno_window - state->send.send_base);
+        state->stats.window_limited_since = current_time();
+      }
+      held = true;
+      break;
+    }
+    data_len = ring->tail_seqno - state->send.nextseqnum;
+    if (data_len > MAX_SEG_DATA_SIZE)
+    {
+      data_len = MAX_SEG_DATA_SIZE;
+    }
+    // Nagle: hold a small segment back while data is in flight
+    else if (data_len < MAX_SEG_DATA_SIZE && !state->nodelay && !state->nagle_flush &&
+             !state->check_read_EOF && state->send.nextseqnum != state->send.send_base)
+    {
+      if (state->nagle_timer.pprev == NULL)
+      {
+        timer_wheel_add(&state->shard->timer_wheel,&state->nagle_timer,current_time() + state->nagle_timeout);
       }
-      
+      held = true;
+      break;
+    }
+    if (data_len > last_seqno_window - state->send.nextseqnum)
+    {
+      data_len = last_seqno_window - state->send.nextseqnum;
+    }
+    if (!ctcp_pacing_admit(state,data_len))
+    {
+      held = true;
+      break;
+    }
+    if (state->stats.window_limited_since != 0)
+    {
+      state->stats.window_limited_ms += current_time() - state->stats.window_limited_since;
+      state->stats.window_limited_since = 0;
     }
-  }while(packet->segment->seqno <= seqno);
 
-  
-}
+    unack = (unack_segment_t*)pool_alloc(&state->unack_pool);
+    unack->seqno = state->send.nextseqnum;
+    unack->data_len = data_len;
+    unack->flags = ACK;
+    unack->last_time_send = current_time();
+    ctcp_send_segment(state,unack);
+    add_list_unacksegment(state,unack);
 
-void ctcp_timer() {
+    state->last_byte_ack = 1;
+    state->send.nextseqnum += data_len;
+    burst ++;
+  }
 
-  // TIMER_INTERVAL 40
-  // Time MAX_SEG_LIFETIME_MS 4000
-  // Time RT_RETRANSMIT 200
+  if (burst > 0)
+  {
+    state->pacing.bursts ++;
+    state->pacing.burst_segments += burst;
+    if (burst > state->pacing.burst_max)
+    {
+      state->pacing.burst_max = burst;
+    }
+  }
+  if (held)
+  {
+    return;
+  }
+  timer_wheel_cancel(&state->nagle_timer);
+  timer_wheel_cancel(&state->persist_timer);
 
-  ctcp_state_t *state_current;
-  state_current = state_list;
-  ll_node_t *node;
-  while (state_current != NULL )
-  {
-    node = ll_front(state_current->linked_list_unack_segment);
-    packet_t *packet;
-
-    while (node != NULL )
-    {
-        packet = (packet_t*)node->object;
-        if ((current_time() - packet->last_time_send)  > state_current->config->rt_timeout)
-        {
-          // Retransmit segment
-          if (packet->num_retransmit >= (MAX_NUM_XMITS))
-          {
-            ctcp_destroy(state_current);
-            return;
-          }
-
-          if (conn_send(state_current->conn,packet->segment,ntohs(packet->segment->len) ) == -1)
-          {
-            fprintf(stderr, "Error\n");
-          }
-          fprintf(stderr,"Time %ld : %ld\n",current_time(),packet->last_time_send);
-          packet->num_retransmit ++;
-          packet->last_time_send = current_time();
-        }
-        node = node->next;
-    }
-    state_current = state_current->next;
+  // Everything read has been sent, FIN takes the next sequence number
+  if (state->check_read_EOF && !state->check_send_FIN)
+  {
+    unack = (unack_segment_t*)pool_alloc(&state->unack_pool);
+    unack->seqno = state->send.nextseqnum;
+    unack->data_len = 0;
+    unack->flags = ACK | FIN;
+    unack->last_time_send = current_time();
+    ctcp_send_segment(state,unack);
+    add_list_unacksegment(state,unack);
+
+    state->check_send_FIN = true;
+    state->passive_close = state->check_receive_FIN;
+    state->send.nextseqnum += 1;
   }
-  
 }
+
 /*
-  Funtion
-  Segment in network byte order ntohl
+  Small data was held back for too long: send it whatever is in flight.
 */
-void segment_ntoh(ctcp_segment_t *segment)
+void ctcp_nagle_timeout(timer_entry_t *entry, long now)
 {
-  segment->seqno = ntohl(segment->seqno);
-  segment->ackno = ntohl(segment->ackno);
-  segment->len = ntohs(segment->len);
-  segment->window = ntohs(segment->window);
-  segment->flags = ntohl(segment->flags);
+  ctcp_state_t *state = (ctcp_state_t*)entry->object;
+
+  (void)now;
+  state->nagle_flush = true;
+  ctcp_send_sliding_window(state);
+  state->nagle_flush = false;
 }
 
-void segment_hton(ctcp_segment_t *segment)
+ctcp_segment_t *generate_data_segment(ctcp_state_t *state, unack_segment_t *unack)
 {
-  segment->seqno = htonl(segment->seqno);
-  segment->ackno = htonl(segment->ackno);
-  segment->len = htons(segment->len);
-  segment->window = htons(segment->window);
-  segment->flags = htonl(segment->flags);
+  ctcp_segment_t * data_segment;
+  uint16_t len_segment = sizeof(ctcp_segment_t) + unack->data_len;
+  data_segment = segment_alloc(state,len_segment);
+
+  data_segment->seqno = unack->seqno;
+  data_segment->ackno = state->receive.recv_base;
+  data_segment->len = len_segment;
+  data_segment->flags = unack->flags | ctcp_wscale_flags(state);
+  if (state->sack_enabled)
+  {
+    data_segment->flags |= SACK_PERMITTED;
+  }
+  data_segment->window = ctcp_advertised_window(state);
+  send_ring_copy(&state->send_ring,unack->seqno,data_segment->data,unack->data_len);
+  segment_hton(data_segment);
+  data_segment->cksum = 0;
+  data_segment->cksum = cksum_fast(data_segment,len_segment);
+
+  return data_segment;
 }
 
-void ctcp_send_ACK(ctcp_state_t* state,packet_t* packet)
+/*
+  Send "unack". The wire image is built once; a resend only patches the
+  fields that may have moved since (ackno and window) and fixes up the
+  checksum incrementally.
+*/
+void ctcp_send_segment(ctcp_state_t *state,unack_segment_t *unack)
 {
-  ctcp_segment_t * segment;
-  uint16_t len_segment = sizeof(ctcp_segment_t);
-  segment = (ctcp_segment_t*)calloc(len_segment, 1);
+  if (unack->wire == NULL)
+  {
+    unack->wire = generate_data_segment(state,unack);
+  }
+  else
+  {
+    ctcp_refresh_segment(state,unack->wire);
+  }
+  ctcp_tx_queue(state,unack->wire,ntohs(unack->wire->len));
+  state->stats.segments_sent ++;
+  state->stats.bytes_sent += unack->data_len;
+  if (unack->first_send_us)
+  {
+    TRACE(state,TRACE_RETRANSMIT,unack->seqno,state->receive.recv_base,unack->data_len);
+    state->stats.segments_retransmitted ++;
+    state->stats.bytes_retransmitted += unack->data_len;
+    unack->send_us = ctcp_clock_us();
+  }
+  else
+  {
+    TRACE(state,TRACE_SEND,unack->seqno,state->receive.recv_base,unack->data_len);
+    unack->first_send_us = unack->send_us = ctcp_clock_us();
+  }
+  // The segment carries recv_base, no separate ACK needed
+  ctcp_clear_delayed_ACK(state);
+}
 
-  segment->seqno = packet->segment->seqno;
-  segment->ackno = packet->segment->ackno;
-  segment->len = len_segment;
-  segment->flags |= ACK;
-  segment->window = state->config->recv_window;
-  segment_ntoh(segment);
-  segment->cksum = 0;
-  segment->cksum = cksum(segment,len_segment);
+void ctcp_refresh_segment(ctcp_state_t *state, ctcp_segment_t *segment)
+{
+  uint32_t ackno = htonl(state->receive.recv_base);
+  uint16_t window = htons(ctcp_advertised_window(state));
+  uint32_t flags = htonl((ntohl(segment->flags) & ~(WSCALE_OPT | WSCALE_SHIFT_MASK)) |
+                         ctcp_wscale_flags(state));
 
-  conn_send(state->conn,segment,len_segment);
+  if (segment->flags != flags)
+  {
+    // Scaling was agreed on since the first transmission
+    segment->cksum = cksum_update(segment->cksum,&segment->flags,&flags,sizeof(uint32_t));
+    segment->flags = flags;
+  }
+  if (segment->ackno != ackno)
+  {
+    segment->cksum = cksum_update(segment->cksum,&segment->ackno,&ackno,sizeof(uint32_t));
+    segment->ackno = ackno;
+  }
+  if (segment->window != window)
+  {
+    segment->cksum = cksum_update(segment->cksum,&segment->window,&window,sizeof(uint16_t));
+    segment->window = window;
+  }
 }
 
-int32_t check_continuous_in_recvlist(linked_list_t *list,packet_t *packet)
+/*
+  The byte range of "unack" changed (merge or partial ACK), its wire image
+  is stale and gets rebuilt on the next send.
+*/
+void ctcp_drop_wire_segment(ctcp_state_t *state, unack_segment_t *unack)
 {
-  uint16_t data_len;
-  ll_node_t *node;
-  ll_node_t *node_next;
-  packet_t *packet_data;
-  packet_t *packet_data_next;
-
-  int32_t ret_seqno;
-  //bool check_continuous = true;
+  tx_batch_t *batch = &state->tx_batch;
+  int index;
 
-  node = ll_find(list,packet);
-  if (node == NULL)
+  if (unack->wire == NULL)
   {
-    return -1;
+    return;
+  }
+  // Still waiting in the batch: send it before the buffer goes
+  for (index = 0; index < batch->count; index++)
+  {
+    if (batch->segments[index] == unack->wire)
+    {
+      ctcp_tx_flush(state);
+      break;
+    }
   }
-  packet_data = (packet_t*)node->object;
-  fprintf(stderr,"seqno %d %d\n",packet_data->segment->seqno, packet_data->segment->len);
+  segment_free(state,unack->wire,ntohs(unack->wire->len));
+  unack->wire = NULL;
+}
 
-  do
+/*
+  Resend the timed out segment in "node". Data segments queued behind it
+  that went out no later than it did are merged into it, up to
+  MAX_SEG_DATA_SIZE, so several small lost segments go out again as one
+  full segment.
+*/
+void ctcp_retransmit_segment(ctcp_state_t *state, ll_node_t *node, long now)
+{
+  unack_segment_t *unack = (unack_segment_t*)node->object;
+  unack_segment_t *unack_next;
+  ll_node_t *node_next;
+  uint32_t room;
+
+  while (!(unack->flags & FIN) && (node_next = node->next) != NULL)
   {
-    data_len = packet_data->segment->len - sizeof(ctcp_segment_t);
-    node_next = node->next;
-    if (node_next == NULL)
+    unack_next = (unack_segment_t*)node_next->object;
+    room = MAX_SEG_DATA_SIZE - unack->data_len;
+    if (room == 0 || (unack_next->flags & FIN) || unack_next->sacked ||
+        unack_next->last_time_send > unack->last_time_send)
     {
-      //fprintf(stderr,"2\n");
-      return -1;
+      break;
     }
 
-    packet_data_next = (packet_t*)node_next->object;
-    if (packet_data->segment->seqno + data_len == packet_data_next->segment->seqno)
+    if (unack_next->data_len <= room)
+    {
+      unack->data_len += unack_next->data_len;
+      if (unack_next->num_retransmit > unack->num_retransmit)
+      {
+        unack->num_retransmit = unack_next->num_retransmit;
+      }
+      free_unack_segment(state,remove_list_unacksegment(state,node_next));
+    }
+    else
     {
-      ret_seqno = packet_data->segment->seqno + data_len;
+      // Take the front of the next segment, it keeps the rest
+      unack->data_len += room;
+      unack_next->seqno += room;
+      unack_next->data_len -= room;
+      ctcp_drop_wire_segment(state,unack_next);
     }
+    ctcp_drop_wire_segment(state,unack);
+  }
 
-    node = node->next;
-  }while(node);
+  ctcp_send_segment(state,unack);
+  unack->num_retransmit ++;
+  unack->last_time_send = now;
+  ctcp_arm_retransmit(state);
+}
+
+/*
+  Data went out: start the retransmission timer unless it is running
+  already for older data.
+*/
+void ctcp_arm_retransmit(ctcp_state_t *state)
+{
+  if (state->rtx_timer.pprev == NULL)
+  {
+    timer_wheel_add(&state->shard->timer_wheel,&state->rtx_timer,current_time() + state->rtt.rto);
+  }
+}
+
+/*
+  New data was acknowledged: stop the timer if nothing is outstanding any
+  more, otherwise give the oldest segment a full RTO from now.
+*/
+void ctcp_restart_retransmit(ctcp_state_t *state)
+{
+  if (ll_front(state->linked_list_unack_segment) == NULL)
+  {
+    timer_wheel_cancel(&state->rtx_timer);
+    return;
+  }
+  timer_wheel_add(&state->shard->timer_wheel,&state->rtx_timer,current_time() + state->rtt.rto);
+}
+
+/*
+  The retransmission timer expired: the oldest segment is presumed lost.
+  Collapse the window, back off and resend that segment alone; the holes
+  behind it are resent as partial ACKs and SACK blocks show them.
+*/
+void ctcp_retransmit_timeout(timer_entry_t *entry, long now)
+{
+  ctcp_state_t *state = (ctcp_state_t*)entry->object;
+  ll_node_t *node = ll_front(state->linked_list_unack_segment);
+  unack_segment_t *unack;
 
-  return ret_seqno;
+  if (node == NULL)
+  {
+    return;
+  }
+  unack = (unack_segment_t*)node->object;
+  if (unack->num_retransmit >= (MAX_NUM_XMITS))
+  {
+    CTCP_LOG(LOG_WARN,"segment %u unacknowledged after %d transmissions, closing\n",
+             unack->seqno,unack->num_retransmit + 1);
+    ctcp_destroy(state);
+    return;
+  }
+  TRACE(state,TRACE_RTO,unack->seqno,state->send.send_base,state->rtt.rto);
+
+  // ssthresh is set by the first timeout of a loss only: on a repeat the
+  // flight is the one already halved (RFC 5681 3.1)
+  if (!state->rto_recovery)
+  {
+    state->cc_ops->on_rto(&state->cc,state->send.nextseqnum - state->send.send_base,now);
+  }
+  state->cc.cwnd = state->cc.mss;
+  state->rto_recovery = true;
+  state->in_fast_recovery = false;
+  state->dup_ack_count = 0;
+  state->recover = state->send.nextseqnum;
+  rtt_backoff(&state->rtt);
+
+  ctcp_retransmit_segment(state,node,now);
+  state->sack_rtx_next = unack->seqno + unack->data_len;
 }
-void add_list_unacksegment(linked_list_t *list,packet_t *packet)
+
+void free_unack_segment(ctcp_state_t *state, unack_segment_t *unack)
 {
-  ll_add(list,packet);
-  ll_node_t *node = ll_front(list);
-  packet_t *packet1 = (packet_t*)node->object; 
+  ctcp_drop_wire_segment(state,unack);
+  pool_free(&state->unack_pool,unack);
 }
 
-void add_packet_in_order(linked_list_t *list, packet_t *packet)
+/*
+  Resend the oldest segment that is not acknowledged yet, without waiting
+  for the retransmission timer, unless this recovery resent it already.
+*/
+void ctcp_fast_retransmit(ctcp_state_t *state)
 {
-  packet_t *packet_temp;
-  uint16_t datalen_of_segment_temp;
-  ll_node_t *node = ll_front(list);
-  ctcp_segment_t *segment = packet->segment;
-  while (node)
+  ll_node_t *node = ll_front(state->linked_list_unack_segment);
+  unack_segment_t *unack;
+
+  if (node == NULL)
   {
-    packet_temp = (packet_t*)node->object;
-    ctcp_segment_t *segment_temp = packet_temp->segment;  
-    datalen_of_segment_temp = segment_temp->len - sizeof(ctcp_segment_t);
-    // List had packet 
-    if (ll_find(list,packet))
+    return;
+  }
+  unack = (unack_segment_t*)node->object;
+  if ((int32_t)(unack->seqno - state->sack_rtx_next) < 0)
+  {
+    return;
+  }
+  state->sack_rtx_next = unack->seqno + unack->data_len;
+  TRACE(state,TRACE_FAST_RETRANSMIT,unack->seqno,state->send.send_base,unack->data_len);
+  ctcp_send_segment(state,unack);
+  unack->num_retransmit ++;
+  unack->last_time_send = current_time();
+  ctcp_arm_retransmit(state);
+}
+
+/*
+  Cumulative ACK: pop every segment that ends at or below "ackno" off the
+  head of the seqno-ordered unacked queue and free it, amortized O(1) per
+  segment. A segment the ACK only partly covers is trimmed in place.
+  The RTT is sampled from the newest segment popped. Karn's rule:
+  retransmitted segments give no sample, since the ACK may belong to any of
+  their transmissions, and neither does an ACK that also covers one: it
+  closed a hole, and the segments behind it waited for that, not the path.
+*/
+void ctcp_release_acked_segments(ctcp_state_t *state, uint32_t ackno)
+{
+  ll_node_t *node;
+  unack_segment_t *unack;
+  long sample_time = 0;
+  uint64_t sample_us = 0;
+  uint64_t now_us = ctcp_clock_us();
+  bool has_sample = false;
+  bool retransmitted = false;
+  uint32_t end;
+
+  while ((node = ll_front(state->linked_list_unack_segment)) != NULL)
+  {
+    unack = (unack_segment_t*)node->object;
+    end = unack->seqno + unack->data_len + ((unack->flags & FIN) ? 1 : 0);
+    if ((int32_t)(end - ackno) > 0)
     {
-      return;
+      if ((int32_t)(ackno - unack->seqno) > 0)
+      {
+        unack->data_len -= ackno - unack->seqno;
+        unack->seqno = ackno;
+        ctcp_drop_wire_segment(state,unack);
+      }
+      break;
     }
-    if (segment->seqno < segment_temp->seqno)
+    retransmitted |= (unack->num_retransmit > 0);
+    has_sample = !retransmitted;
+    sample_time = unack->last_time_send;
+    sample_us = unack->send_us;
+    hist_record(&state->stats.ack_latency,now_us - unack->first_send_us);
+    free_unack_segment(state,remove_list_unacksegment(state,node));
+  }
+
+  if (has_sample)
+  {
+    rtt_sample(&state->rtt,current_time() - sample_time);
+    hist_record(&state->stats.rtt,now_us - sample_us);
+  }
+}
+
+/*
+  Sender side of an incoming ACK: release acked bytes, count duplicate
+  ACKs and run fast retransmit / fast recovery (RFC 5681, RFC 6582).
+*/
+void ctcp_handle_ack(ctcp_state_t *state, ctcp_segment_t *segment, uint16_t data_len)
+{
+  uint32_t ackno = segment->ackno;
+  uint32_t in_flight = state->send.nextseqnum - state->send.send_base;
+  uint32_t acked;
+  cc_state_t *cc = &state->cc;
+  bool window_update = false;
+  uint32_t window = segment->window;
+
+  // Take the window of any ACK that is not older than send_base
+  if (segment->flags & WSCALE_OPT)
+  {
+    window <<= state->snd_wscale;
+  }
+  if ((int32_t)(ackno - state->send.send_base) >= 0 &&
+      (int32_t)(ackno - state->send.nextseqnum) <= 0)
+  {
+    window_update = (window != state->peer_window);
+    state->peer_window = window;
+  }
+
+  if (ackno == state->send.send_base)
+  {
+    // Pure ACK for send_base, same window, data outstanding: duplicate
+    if (data_len > 0 || (segment->flags & FIN) || in_flight == 0 || window_update)
     {
-      ll_add_front(list,packet);
+      ctcp_send_sliding_window(state);
       return;
     }
-    if (segment->seqno >= segment_temp->seqno + datalen_of_segment_temp)
+    state->dup_ack_count ++;
+    if (state->in_fast_recovery)
     {
-      ll_add_after(list,node,packet);
-      return;
+      // Every duplicate means a segment left the network: inflate
+      cc->cwnd += cc->mss;
+      ctcp_sack_retransmit_hole(state);
+      ctcp_send_sliding_window(state);
     }
-    node = node->next;
+    else if (state->rto_recovery)
+    {
+      ctcp_sack_retransmit_hole(state);
+    }
+    else if (state->dup_ack_count == DUP_ACK_THRESHOLD &&
+             (int32_t)(ackno - state->recover) > 0)
+    {
+      state->in_fast_recovery = true;
+      state->recover = state->send.nextseqnum;
+      state->cc_ops->on_loss(cc,in_flight,current_time());
+      state->sack_rtx_next = state->send.send_base;
+      ctcp_fast_retransmit(state);
+      cc->cwnd = cc->ssthresh + DUP_ACK_THRESHOLD * cc->mss;
+      ctcp_send_sliding_window(state);
+    }
+    return;
+  }
+
+  // Acked bytes leave the send ring, which reopens the window
+  if ((int32_t)(ackno - state->send.send_base) <= 0 ||
+      (int32_t)(ackno - state->send.nextseqnum) > 0)
+  {
+    return;
+  }
+  acked = ackno - state->send.send_base;
+  ctcp_release_acked_segments(state,ackno);
+  state->dup_ack_count = 0;
+  state->send.send_base = ackno;
+  send_ring_release(&state->send_ring,ackno);
+  ctcp_restart_retransmit(state);
+
+  if (state->in_fast_recovery)
+  {
+    if ((int32_t)(ackno - state->recover) >= 0)
+    {
+      // Full ACK: deflate the window and leave recovery
+      in_flight = state->send.nextseqnum - ackno;
+      cc->cwnd = (in_flight + cc->mss < cc->ssthresh) ? in_flight + cc->mss : cc->ssthresh;
+      state->in_fast_recovery = false;
+    }
+    else
+    {
+      // Partial ACK: the next hole is lost too, stay in recovery
+      ctcp_fast_retransmit(state);
+      cc->cwnd = (cc->cwnd > acked) ? cc->cwnd - acked : 0;
+      cc->cwnd += cc->mss;
+    }
+  }
+  else
+  {
+    state->cc_ops->on_ack(cc,acked,current_time());
+    if (state->rto_recovery)
+    {
+      if ((int32_t)(ackno - state->recover) >= 0)
+      {
+        state->rto_recovery = false;
+      }
+      else
+      {
+        // Partial ACK after a timeout: the next hole is lost too
+        ctcp_fast_retransmit(state);
+      }
+    }
+  }
+  ctcp_send_sliding_window(state);
+}
+
+void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len) {
+  uint32_t next_seqno = state->recv_ring.next_seqno;
+  ctcp_segment_t *sack_hint = NULL;
+  bool ack_now;
+
+  if (!ctcp_segment_check(state,segment,len))
+  {
+    free(segment);
+    return;
   }
+  ack_now = ctcp_process_segment(state,segment,&sack_hint);
+  ctcp_receive_done(state,next_seqno,ack_now,sack_hint);
+  free(segment);
+  ctcp_tx_flush(state);
+  ctcp_check_teardown(state);
 }
-void remove_packet_in_unacksegment(linked_list_t *list,packet_t *packet_search)
+
+/*
+  Batched ingress: "count" datagrams pulled in one go (recvmmsg() into
+  buffers the caller owns and keeps, nothing is freed here). Taken in
+  chunks of up to RX_BATCH_MAX; the rest of the batch is dropped once a
+  chunk has torn the connection down.
+*/
+void ctcp_receive_batch(ctcp_state_t *state, ctcp_segment_t **segments, size_t *lens, int count)
 {
-  ll_node_t *node;
-  packet_t *packet;
-  bool check_find = false;
-  node = ll_front(list);
-  while(node)
+  int chunk;
+
+  while (count > 0)
   {
-    packet = (packet_t*)node->object;
-    fprintf(stderr,"packet seqno %d\n",packet->segment->seqno);
-    if (packet->segment->seqno == packet_search->segment->seqno)
+    chunk = (count < RX_BATCH_MAX) ? count : RX_BATCH_MAX;
+    if (ctcp_receive_chunk(state,segments,lens,chunk))
     {
-      ll_remove(list,node);
-      check_find = true;
       return;
     }
-    node = node->next;
+    segments += chunk;
+    lens += chunk;
+    count -= chunk;
+  }
+}
+
+/*
+  Checksums are verified for the whole chunk first, then the segments run
+  through the protocol, and delivery, the ACK decision and the transmit
+  flush happen once for the chunk. Returns true when the state was
+  destroyed.
+*/
+static bool ctcp_receive_chunk(ctcp_state_t *state, ctcp_segment_t **segments, size_t *lens,
+                               int count)
+{
+  uint32_t next_seqno = state->recv_ring.next_seqno;
+  ctcp_segment_t *sack_hint = NULL;
+  bool valid[RX_BATCH_MAX];
+  bool ack_now = false;
+  int index;
+
+  for (index = 0; index < count; index++)
+  {
+    valid[index] = ctcp_segment_check(state,segments[index],lens[index]);
   }
-  if (!check_find)
+  for (index = 0; index < count; index++)
   {
-    fprintf(stderr,"err find\n");
+    if (valid[index])
+    {
+      ack_now |= ctcp_process_segment(state,segments[index],&sack_hint);
+    }
   }
+  ctcp_receive_done(state,next_seqno,ack_now,sack_hint);
+  ctcp_tx_flush(state);
+  return ctcp_check_teardown(state);
 }
+
+/*
+  Length and checksum of a segment as it came off the wire. Converts it to
+  host order when it is good.
+*/
+bool ctcp_segment_check(ctcp_state_t *state, ctcp_segment_t *segment, size_t len)
+{
+  uint16_t checksum_check;
+  uint16_t checksum_recv;
+
+  if (len < sizeof(ctcp_segment_t) || len < ntohs(segment->len) ||
+      ntohs(segment->len) < sizeof(ctcp_segment_t))
+  {
+    TRACE(state,TRACE_CORRUPT,0,0,len);
+    state->stats.cksum_failures ++;
+    return false;
+  }
+
+  checksum_recv = segment->cksum;
+  segment->cksum = 0;
+  checksum_check = cksum_fast(segment,ntohs(segment->len));
+  if (checksum_recv != checksum_check)
+  {
+    CTCP_LOG(LOG_DEBUG,"corrupt segment, checksum %d, expected %d\n",checksum_recv,checksum_check);
+    TRACE(state,TRACE_CORRUPT,checksum_recv,checksum_check,ntohs(segment->len));
+    state->stats.cksum_failures ++;
+    return false;
+  }
+
+  segment_ntoh(segment);
+  TRACE(state,TRACE_RECV,segment->seqno,segment->ackno,segment->len);
+  state->stats.segments_received ++;
+  return true;
+}
+
+/*
+  Protocol work for one good segment: options, ACK, then payload and FIN.
+  Returns true when it calls for an immediate ACK; "*sack_hint" is set to
+  the segment whose SACK block should go first.
+*/
+bool ctcp_process_segment(ctcp_state_t *state, ctcp_segment_t *segment, ctcp_segment_t **sack_hint)
+{
+  uint16_t data_len = segment->len - sizeof(ctcp_segment_t);
+
+  if (segment->flags & SACK_PERMITTED)
+  {
+    state->peer_sack_ok = true;
+  }
+  if ((segment->flags & WSCALE_OPT) && state->wscale_enabled)
+  {
+    state->peer_wscale_ok = true;
+    state->snd_wscale = (segment->flags & WSCALE_SHIFT_MASK) >> WSCALE_SHIFT_BITS;
+    if (state->snd_wscale > WSCALE_MAX)
+    {
+      state->snd_wscale = WSCALE_MAX;
+    }
+  }
+  if (segment->flags & SACK_OPT)
+  {
+    // Data holds SACK blocks, not payload
+    if (segment->flags & ACK)
+    {
+      ctcp_handle_sack(state,segment,data_len);
+    }
+    data_len = 0;
+  }
+
+  if (segment->flags & ACK)
+  {
+    state->last_byte_ack += data_len;
+    state->receive.last_seqnum += data_len;
+    ctcp_handle_ack(state,segment,data_len);
+  }
+  if (segment->flags & FIN)
+  {
+    state->last_byte_ack += 1;
+    // Our ACK of the FIN was lost, wait for the next one all over again
+    if (state->linger_timer.pprev != NULL)
+    {
+      timer_wheel_add(&state->shard->timer_wheel,&state->linger_timer,current_time() + LINGER_TIMEOUT);
+    }
+  }
+
+  if (data_len > 0 || (segment->flags & FIN))
+  {
+    return ctcp_receive_data(state,segment,data_len,sack_hint);
+  }
+  // Zero window probe
+  return (int32_t)(segment->seqno - state->receive.recv_base) < 0;
+}
+
+/*
+  Place the payload (and FIN) of "segment" in the receive ring and move
+  recv_base over whatever became contiguous. Holes, duplicates and the FIN
+  want an ACK at once, plain in order data goes through the delayed ACK.
+*/
+bool ctcp_receive_data(ctcp_state_t *state, ctcp_segment_t *segment, uint16_t data_len,
+                       ctcp_segment_t **sack_hint)
+{
+  recv_ring_t *ring = &state->recv_ring;
+  uint32_t num_ranges = ring->num_ranges;
+  uint32_t delivered = ring->next_seqno;
+
+  if (data_len > 0)
+  {
+    if ((int32_t)(segment->seqno + data_len - delivered) <= 0)
+    {
+      state->stats.duplicates ++;
+    }
+    else if ((int32_t)(segment->seqno - delivered) > 0)
+    {
+      state->stats.out_of_order ++;
+    }
+  }
+  if ((segment->flags & FIN) && !state->fin_seen)
+  {
+    state->fin_seen = true;
+    state->fin_seqno = segment->seqno + data_len;
+  }
+
+  recv_ring_insert(ring,segment->seqno,(char*)segment->data,data_len);
+  state->receive.recv_base = ring->next_seqno;
+  if (state->fin_seen && ring->next_seqno == state->fin_seqno)
+  {
+    state->check_receive_FIN = true;
+    state->receive.recv_base += 1;
+  }
+
+  if (ring->next_seqno == delivered)
+  {
+    // Out of order or old data, our ACK may have been lost
+    if (data_len > 0)
+    {
+      *sack_hint = segment;
+    }
+    return true;
+  }
+  // Filled (part of) a hole, or the peer is done: no reason to wait
+  return state->check_receive_FIN || ring->num_ranges < num_ranges || ring->num_ranges > 0;
+}
+
+/*
+  After one segment or one batch: deliver, then ACK now or delay the ACK
+  for the in order bytes that arrived since "next_seqno".
+*/
+void ctcp_receive_done(ctcp_state_t *state, uint32_t next_seqno, bool ack_now,
+                       ctcp_segment_t *sack_hint)
+{
+  ctcp_deliver(state);
+
+  if (ack_now)
+  {
+    ctcp_send_ACK(state,sack_hint);
+  }
+  else if (state->recv_ring.next_seqno != next_seqno)
+  {
+    ctcp_delay_ACK(state,state->recv_ring.next_seqno - next_seqno);
+  }
+}
+
+/*
+  Hand in order data to the application as far as its buffer allows, then
+  EOF once the FIN has been reached.
+*/
+void ctcp_deliver(ctcp_state_t *state)
+{
+  recv_ring_t *ring = &state->recv_ring;
+  size_t space;
+  uint32_t len;
+  char *data;
+
+  while ((len = recv_ring_readable(ring,&data)) > 0)
+  {
+    space = conn_bufspace(state->conn);
+    if (space == 0)
+    {
+      return;
+    }
+    if (len > space)
+    {
+      len = space;
+    }
+    if (conn_output(state->conn,data,len) < 0)
+    {
+      return;
+    }
+    TRACE(state,TRACE_DELIVER,ring->read_seqno,0,len);
+    recv_ring_consume(ring,len);
+    state->stats.bytes_delivered += len;
+  }
+
+  if (state->check_receive_FIN && !state->check_output_EOF)
+  {
+    conn_output(state->conn,NULL,0);
+    state->check_output_EOF = true;
+  }
+}
+
+/*
+  Both directions are closed: the peer's FIN was delivered and ours is
+  acknowledged. After a passive close the state is destroyed; after an
+  active one it lingers and ctcp_linger_timeout() destroys it. Returns true
+  when the state was destroyed.
+*/
+bool ctcp_check_teardown(ctcp_state_t *state)
+{
+  if (!state->check_output_EOF || !state->check_send_FIN ||
+      state->send.send_base != state->send.nextseqnum)
+  {
+    return false;
+  }
+  if (state->passive_close)
+  {
+    ctcp_destroy(state);
+    return true;
+  }
+  if (state->linger_timer.pprev == NULL)
+  {
+    timer_wheel_add(&state->shard->timer_wheel,&state->linger_timer,current_time() + LINGER_TIMEOUT);
+  }
+  return false;
+}
+
+void ctcp_linger_timeout(timer_entry_t *entry, long now)
+{
+  (void)now;
+  ctcp_destroy((ctcp_state_t*)entry->object);
+}
+
+void ctcp_output(ctcp_state_t *state) {
+  recv_ring_t *ring = &state->recv_ring;
+  uint32_t window = ctcp_recv_window_limit(state);
+  uint32_t step = MAX_SEG_DATA_SIZE;
+
+  // Room freed up in the output buffer, deliver what was held back
+  ctcp_deliver(state);
+
+  // Tell the peer once the window has opened up by a worthwhile step
+  if (step > window / 2)
+  {
+    step = window / 2;
+  }
+  if ((int32_t)(ring->read_seqno + window - state->adv_edge) >= (int32_t)step &&
+      (int32_t)(state->adv_edge - ring->next_seqno) < MAX_SEG_DATA_SIZE)
+  {
+    ctcp_send_ACK(state,NULL);
+  }
+  ctcp_tx_flush(state);
+  ctcp_check_teardown(state);
+}
+
+void ctcp_timer() {
+
+  // TIMER_INTERVAL 40
+  // Time MAX_SEG_LIFETIME_MS 4000
+  // Time RT_RETRANSMIT 200
+
+  // Only the deadlines that expired since the last tick are visited, and
+  // only those of the calling worker's shard
+  if (ctcp_shard->timer_wheel.initialized)
+  {
+    timer_wheel_advance(&ctcp_shard->timer_wheel,current_time());
+  }
+  ctcp_tx_flush_all();
+#if STATS_SIGNAL
+  if (ctcp_shard->stats_seen != stats_requests)
+  {
+    ctcp_shard->stats_seen = stats_requests;
+    ctcp_stats_dump(stderr);
+  }
+#endif
+}
+/*
+  Funtion
+  Segment in network byte order ntohl
+*/
+void segment_ntoh(ctcp_segment_t *segment)
+{
+  segment->seqno = ntohl(segment->seqno);
+  segment->ackno = ntohl(segment->ackno);
+  segment->len = ntohs(segment->len);
+  segment->window = ntohs(segment->window);
+  segment->flags = ntohl(segment->flags);
+}
+
+void segment_hton(ctcp_segment_t *segment)
+{
+  segment->seqno = htonl(segment->seqno);
+  segment->ackno = htonl(segment->ackno);
+  segment->len = htons(segment->len);
+  segment->window = htons(segment->window);
+  segment->flags = htonl(segment->flags);
+}
+
+/*
+  Mark the unacked segments covered by the peer's SACK blocks, so that
+  only the holes between them get retransmitted.
+*/
+void ctcp_handle_sack(ctcp_state_t *state, ctcp_segment_t *segment, uint16_t sack_len)
+{
+  uint16_t num_blocks = sack_len / (2 * sizeof(uint32_t));
+  uint32_t block[2];
+  uint32_t start;
+  uint32_t end;
+  uint16_t index;
+  ll_node_t *node;
+  unack_segment_t *unack;
+
+  if (num_blocks > SACK_MAX_BLOCKS)
+  {
+    num_blocks = SACK_MAX_BLOCKS;
+  }
+  for (index = 0; index < num_blocks; index++)
+  {
+    memcpy(block,segment->data + index * sizeof(block),sizeof(block));
+    start = ntohl(block[0]);
+    end = ntohl(block[1]);
+    if ((int32_t)(end - state->send.send_base) <= 0 ||
+        (int32_t)(end - state->send.nextseqnum) > 0 ||
+        (int32_t)(end - start) <= 0)
+    {
+      continue;
+    }
+
+    node = ll_front(state->linked_list_unack_segment);
+    while (node)
+    {
+      unack = (unack_segment_t*)node->object;
+      if ((int32_t)(unack->seqno - end) >= 0)
+      {
+        break;
+      }
+      if (unack->data_len > 0 && (int32_t)(unack->seqno - start) >= 0 &&
+          (int32_t)(unack->seqno + unack->data_len - end) <= 0)
+      {
+        unack->sacked = true;
+      }
+      node = node->next;
+    }
+
+    if ((int32_t)(end - state->sack_high) > 0)
+    {
+      state->sack_high = end;
+    }
+  }
+}
+
+/*
+  In fast recovery or after a timeout, resend the next hole below the
+  highest SACKed byte that has not been resent yet in this recovery.
+*/
+void ctcp_sack_retransmit_hole(ctcp_state_t *state)
+{
+  ll_node_t *node = ll_front(state->linked_list_unack_segment);
+  unack_segment_t *unack;
+
+  if ((int32_t)(state->sack_high - state->send.send_base) <= 0)
+  {
+    return;
+  }
+  while (node)
+  {
+    unack = (unack_segment_t*)node->object;
+    if ((int32_t)(unack->seqno - state->sack_high) >= 0)
+    {
+      return;
+    }
+    if (!unack->sacked && (int32_t)(unack->seqno - state->sack_rtx_next) >= 0)
+    {
+      ctcp_send_segment(state,unack);
+      unack->num_retransmit ++;
+      unack->last_time_send = current_time();
+      ctcp_arm_retransmit(state);
+      state->sack_rtx_next = unack->seqno + unack->data_len;
+      return;
+    }
+    node = node->next;
+  }
+}
+
+/*
+  SACK blocks for the out of order ranges of the receive ring, in network
+  order. The range holding "segment", the one just received, goes first
+  (RFC 2018). "segment" may be NULL.
+*/
+uint16_t ctcp_build_sack_blocks(ctcp_state_t *state, ctcp_segment_t *segment, uint32_t *blocks)
+{
+  recv_ring_t *ring = &state->recv_ring;
+  uint32_t first = ring->num_ranges;
+  uint32_t index;
+  uint16_t num_blocks = 0;
+
+  if (segment != NULL)
+  {
+    for (index = 0; index < ring->num_ranges; index++)
+    {
+      if ((int32_t)(segment->seqno - ring->ranges[index].start) >= 0 &&
+          (int32_t)(segment->seqno - ring->ranges[index].end) < 0)
+      {
+        blocks[0] = htonl(ring->ranges[index].start);
+        blocks[1] = htonl(ring->ranges[index].end);
+        first = index;
+        num_blocks = 1;
+        break;
+      }
+    }
+  }
+
+  for (index = 0; index < ring->num_ranges && num_blocks < SACK_MAX_BLOCKS; index++)
+  {
+    if (index == first)
+    {
+      continue;
+    }
+    blocks[2 * num_blocks] = htonl(ring->ranges[index].start);
+    blocks[2 * num_blocks + 1] = htonl(ring->ranges[index].end);
+    num_blocks ++;
+  }
+  return num_blocks;
+}
+
+/*
+  Send a pure ACK for recv_base right away. "segment" is the segment that
+  triggered it, if any, and only decides the order of the SACK blocks.
+*/
+void ctcp_send_ACK(ctcp_state_t* state,ctcp_segment_t* segment_recv)
+{
+  ctcp_send_pure_ACK(state,segment_recv,state->send.nextseqnum);
+}
+
+void ctcp_send_pure_ACK(ctcp_state_t* state,ctcp_segment_t* segment_recv,uint32_t seqno)
+{
+  ctcp_segment_t * segment = state->ack_segment;
+  uint32_t blocks[2 * SACK_MAX_BLOCKS];
+  uint16_t num_blocks = 0;
+  uint16_t len_segment;
+
+  if (state->sack_enabled && state->peer_sack_ok)
+  {
+    num_blocks = ctcp_build_sack_blocks(state,segment_recv,blocks);
+  }
+  len_segment = sizeof(ctcp_segment_t) + num_blocks * 2 * sizeof(uint32_t);
+
+  segment->seqno = seqno;
+  segment->ackno = state->receive.recv_base;
+  segment->len = len_segment;
+  segment->flags = ACK | ctcp_wscale_flags(state);
+  if (state->sack_enabled)
+  {
+    segment->flags |= SACK_PERMITTED;
+  }
+  if (num_blocks > 0)
+  {
+    segment->flags |= SACK_OPT;
+    memcpy(segment->data,blocks,num_blocks * 2 * sizeof(uint32_t));
+  }
+  segment->window = ctcp_advertised_window(state);
+  segment_hton(segment);
+  segment->cksum = 0;
+  segment->cksum = cksum_fast(segment,len_segment);
+
+  ctcp_tx_queue(state,segment,len_segment);
+  TRACE(state,TRACE_ACK,seqno,state->receive.recv_base,num_blocks);
+  state->stats.acks_sent ++;
+  ctcp_clear_delayed_ACK(state);
+}
+
+/*
+  "data_len" in order bytes were delivered: ACK them now if enough are
+  waiting, otherwise make sure the delayed ACK timer is running.
+*/
+void ctcp_delay_ACK(ctcp_state_t *state, uint32_t data_len)
+{
+  state->delack_bytes += data_len;
+  if (state->delack_bytes >= (uint32_t)state->delack_segments * MAX_SEG_DATA_SIZE)
+  {
+    ctcp_send_ACK(state,NULL);
+    return;
+  }
+  if (state->delack_timer.pprev == NULL)
+  {
+    timer_wheel_add(&state->shard->timer_wheel,&state->delack_timer,current_time() + state->delack_timeout);
+  }
+}
+
+void ctcp_delack_timeout(timer_entry_t *entry, long now)
+{
+  ctcp_state_t *state = (ctcp_state_t*)entry->object;
+
+  (void)now;
+  if (state->delack_bytes > 0)
+  {
+    ctcp_send_ACK(state,NULL);
+  }
+}
+
+void ctcp_clear_delayed_ACK(ctcp_state_t *state)
+{
+  state->delack_bytes = 0;
+  timer_wheel_cancel(&state->delack_timer);
+}
+
+/*
+  Append to linked_list_unack_segment through the node embedded in the
+  segment, instead of ll_add() mallocing one for every segment sent.
+*/
+void add_list_unacksegment(ctcp_state_t *state,unack_segment_t *unack)
+{
+  linked_list_t *list = state->linked_list_unack_segment;
+
+  unack->node = &unack->link;
+  unack->node->object = unack;
+  unack->node->next = NULL;
+  unack->node->prev = list->tail;
+  if (list->tail)
+  {
+    list->tail->next = unack->node;
+  }
+  else
+  {
+    list->head = unack->node;
+  }
+  list->tail = unack->node;
+  list->length ++;
+  ctcp_arm_retransmit(state);
+}
+
+/*
+  Unlink an embedded node. Unlike ll_remove() it frees nothing, the node
+  goes back to the pool along with its segment.
+*/
+unack_segment_t *remove_list_unacksegment(ctcp_state_t *state, ll_node_t *node)
+{
+  linked_list_t *list = state->linked_list_unack_segment;
+
+  if (node->prev)
+  {
+    node->prev->next = node->next;
+  }
+  else
+  {
+    list->head = node->next;
+  }
+  if (node->next)
+  {
+    node->next->prev = node->prev;
+  }
+  else
+  {
+    list->tail = node->prev;
+  }
+  list->length --;
+  return (unack_segment_t*)node->object;
+}
+
+void send_ring_init(send_ring_t *ring, uint32_t min_size, uint32_t seqno)
+{
+  ring->size = SEND_RING_SIZE;
+  while (ring->size < min_size)
+  {
+    ring->size <<= 1;
+  }
+  ring->buf = (char*)calloc(ring->size,1);
+  ring->head_seqno = seqno;
+  ring->tail_seqno = seqno;
+}
+
+uint32_t send_ring_space(send_ring_t *ring)
+{
+  return ring->size - (ring->tail_seqno - ring->head_seqno);
+}
+
+void send_ring_write(send_ring_t *ring, const char *data, uint32_t len)
+{
+  uint32_t offset = ring->tail_seqno & (ring->size - 1);
+  uint32_t first = ring->size - offset;
+
+  if (first > len)
+  {
+    first = len;
+  }
+  memcpy(ring->buf + offset,data,first);
+  memcpy(ring->buf,data + first,len - first);
+  ring->tail_seqno += len;
+}
+
+/*
+  Contiguous free space at the tail of the ring, for conn_input() to fill
+  in place. NULL when the ring is full.
+*/
+char *send_ring_write_ptr(send_ring_t *ring, uint32_t *len)
+{
+  uint32_t offset = ring->tail_seqno & (ring->size - 1);
+  uint32_t space = send_ring_space(ring);
+
+  if (space == 0)
+  {
+    return NULL;
+  }
+  *len = ring->size - offset;
+  if (*len > space)
+  {
+    *len = space;
+  }
+  return ring->buf + offset;
+}
+
+void send_ring_commit(send_ring_t *ring, uint32_t len)
+{
+  ring->tail_seqno += len;
+}
+
+void send_ring_copy(send_ring_t *ring, uint32_t seqno, char *dst, uint32_t len)
+{
+  uint32_t offset = seqno & (ring->size - 1);
+  uint32_t first = ring->size - offset;
+
+  if (first > len)
+  {
+    first = len;
+  }
+  memcpy(dst,ring->buf + offset,first);
+  memcpy(dst + first,ring->buf,len - first);
+}
+
+/*
+  Drop every byte below "seqno" from the ring. Acks outside of
+  (head_seqno, tail_seqno] are ignored.
+*/
+void send_ring_release(send_ring_t *ring, uint32_t seqno)
+{
+  if ((int32_t)(seqno - ring->head_seqno) <= 0 ||
+      (int32_t)(seqno - ring->tail_seqno) > 0)
+  {
+    return;
+  }
+  ring->head_seqno = seqno;
+}
+
+void recv_ring_init(recv_ring_t *ring, uint32_t min_size, uint32_t seqno)
+{
+  memset(ring,0,sizeof(recv_ring_t));
+  ring->size = MAX_SEG_DATA_SIZE;
+  if (ring->size < min_size)
+  {
+    ring->size = min_size;
+  }
+  // Round up to a power of 2
+  ring->size--;
+  ring->size |= ring->size >> 1;
+  ring->size |= ring->size >> 2;
+  ring->size |= ring->size >> 4;
+  ring->size |= ring->size >> 8;
+  ring->size |= ring->size >> 16;
+  ring->size++;
+  ring->max_ranges = ring->size / MAX_SEG_DATA_SIZE / 2 + 1;
+  ring->buf = (char*)calloc(ring->size + ring->max_ranges * sizeof(recv_range_t),1);
+  ring->ranges = (recv_range_t*)(ring->buf + ring->size);
+  ring->read_seqno = seqno;
+  ring->next_seqno = seqno;
+}
+
+static void recv_ring_write(recv_ring_t *ring, uint32_t seqno, const char *data, uint32_t len)
+{
+  uint32_t offset = seqno & (ring->size - 1);
+  uint32_t first = ring->size - offset;
+
+  if (first > len)
+  {
+    first = len;
+  }
+  memcpy(ring->buf + offset,data,first);
+  memcpy(ring->buf,data + first,len - first);
+}
+
+/*
+  Store "len" bytes at "seqno". Whatever lies below next_seqno or past the
+  end of the ring is cut off first. Returns true when the segment brought
+  bytes that were not held yet.
+*/
+bool recv_ring_insert(recv_ring_t *ring, uint32_t seqno, const char *data, uint32_t len)
+{
+  uint32_t window_end = ring->read_seqno + ring->size;
+  uint32_t end = seqno + len;
+  uint32_t first, last;
+
+  if ((int32_t)(ring->next_seqno - seqno) > 0)
+  {
+    if ((int32_t)(end - ring->next_seqno) <= 0)
+    {
+      return false;
+    }
+    data += ring->next_seqno - seqno;
+    seqno = ring->next_seqno;
+  }
+  if ((int32_t)(end - window_end) > 0)
+  {
+    end = window_end;
+  }
+  if ((int32_t)(end - seqno) <= 0)
+  {
+    return false;
+  }
+
+  if (seqno == ring->next_seqno)
+  {
+    recv_ring_write(ring,seqno,data,end - seqno);
+    ring->next_seqno = end;
+    // Swallow the ranges that are contiguous now
+    for (first = 0; first < ring->num_ranges; first++)
+    {
+      if ((int32_t)(ring->ranges[first].start - ring->next_seqno) > 0)
+      {
+        break;
+      }
+      if ((int32_t)(ring->ranges[first].end - ring->next_seqno) > 0)
+      {
+        ring->next_seqno = ring->ranges[first].end;
+      }
+    }
+    ring->num_ranges -= first;
+    memmove(ring->ranges,ring->ranges + first,ring->num_ranges * sizeof(recv_range_t));
+    return true;
+  }
+
+  // Out of order, ranges [first, last) overlap or touch [seqno, end)
+  for (first = 0; first < ring->num_ranges; first++)
+  {
+    if ((int32_t)(ring->ranges[first].end - seqno) >= 0)
+    {
+      break;
+    }
+  }
+  for (last = first; last < ring->num_ranges; last++)
+  {
+    if ((int32_t)(ring->ranges[last].start - end) > 0)
+    {
+      break;
+    }
+  }
+
+  if (first == last)
+  {
+    if (ring->num_ranges == ring->max_ranges)
+    {
+      return false;
+    }
+    recv_ring_write(ring,seqno,data,end - seqno);
+    memmove(ring->ranges + first + 1,ring->ranges + first,
+            (ring->num_ranges - first) * sizeof(recv_range_t));
+    ring->num_ranges ++;
+  }
+  else
+  {
+    if (last == first + 1 &&
+        (int32_t)(seqno - ring->ranges[first].start) >= 0 &&
+        (int32_t)(end - ring->ranges[first].end) <= 0)
+    {
+      // Duplicate
+      return false;
+    }
+    recv_ring_write(ring,seqno,data,end - seqno);
+    if ((int32_t)(ring->ranges[first].start - seqno) < 0)
+    {
+      seqno = ring->ranges[first].start;
+    }
+    if ((int32_t)(ring->ranges[last - 1].end - end) > 0)
+    {
+      end = ring->ranges[last - 1].end;
+    }
+    memmove(ring->ranges + first + 1,ring->ranges + last,
+            (ring->num_ranges - last) * sizeof(recv_range_t));
+    ring->num_ranges -= last - first - 1;
+  }
+  ring->ranges[first].start = seqno;
+  ring->ranges[first].end = end;
+  return true;
+}
+
+/*
+  In order bytes not delivered yet that are contiguous in memory, at
+  "*data". Whatever wraps around is returned by the next call.
+*/
+uint32_t recv_ring_readable(recv_ring_t *ring, char **data)
+{
+  uint32_t offset = ring->read_seqno & (ring->size - 1);
+  uint32_t len = ring->next_seqno - ring->read_seqno;
+
+  if (len > ring->size - offset)
+  {
+    len = ring->size - offset;
+  }
+  *data = ring->buf + offset;
+  return len;
+}
+
+void recv_ring_consume(recv_ring_t *ring, uint32_t len)
+{
+  ring->read_seqno += len;
+}
+
+void ctcp_set_congestion_control(ctcp_state_t *state, cc_type_t type)
+{
+  switch (type)
+  {
+    case CC_CUBIC:
+      state->cc_ops = &cc_cubic_ops;
+      break;
+    case CC_NEWRENO:
+    default:
+      state->cc_ops = &cc_newreno_ops;
+      break;
+  }
+  state->cc_ops->init(&state->cc,MAX_SEG_DATA_SIZE);
+}
+
+/*
+  Receive and send buffer sizes in bytes, beyond the 16-bit ctcp_config_t
+  fields. Only before any data went through: both rings start over empty.
+*/
+void ctcp_set_windows(ctcp_state_t *state, uint32_t recv_window, uint32_t send_window)
+{
+  state->recv_window = recv_window;
+  state->send_window = send_window;
+  // Smallest shift that lets the field cover the whole receive buffer
+  state->rcv_wscale = 0;
+  while (state->rcv_wscale < WSCALE_MAX &&
+         (state->recv_window >> state->rcv_wscale) > WINDOW_MAX)
+  {
+    state->rcv_wscale ++;
+  }
+  free(state->send_ring.buf);
+  free(state->recv_ring.buf);
+  send_ring_init(&state->send_ring,state->send_window,1);
+  recv_ring_init(&state->recv_ring,state->recv_window,1);
+}
+
+/*
+  Slow start and loss reaction, common to NewReno and CUBIC.
+*/
+static void cc_slow_start(cc_state_t *cc, uint32_t bytes_acked)
+{
+  cc->cwnd += (bytes_acked < cc->mss) ? bytes_acked : cc->mss;
+}
+
+static uint32_t cc_reduce(cc_state_t *cc, uint32_t window)
+{
+  return (window > 2 * cc->mss) ? window : 2 * cc->mss;
+}
+
+void cc_newreno_init(cc_state_t *cc, uint32_t mss)
+{
+  memset(cc,0,sizeof(cc_state_t));
+  cc->mss = mss;
+  // RFC 3390 initial window
+  cc->cwnd = 4 * mss;
+  if (cc->cwnd > 4380)
+  {
+    cc->cwnd = (2 * mss > 4380) ? 2 * mss : 4380;
+  }
+  cc->ssthresh = UINT32_MAX;
+}
+
+void cc_newreno_on_ack(cc_state_t *cc, uint32_t bytes_acked, long now)
+{
+  (void)now;
+  if (cc->cwnd < cc->ssthresh)
+  {
+    cc_slow_start(cc,bytes_acked);
+    return;
+  }
+
+  // Congestion avoidance: one mss per cwnd of acked bytes
+  cc->bytes_acked += bytes_acked;
+  if (cc->bytes_acked >= cc->cwnd)
+  {
+    cc->bytes_acked -= cc->cwnd;
+    cc->cwnd += cc->mss;
+  }
+}
+
+void cc_newreno_on_loss(cc_state_t *cc, uint32_t in_flight, long now)
+{
+  (void)now;
+  cc->ssthresh = cc_reduce(cc,in_flight / 2);
+  cc->cwnd = cc->ssthresh;
+  cc->bytes_acked = 0;
+}
+
+void cc_newreno_on_rto(cc_state_t *cc, uint32_t in_flight, long now)
+{
+  (void)now;
+  cc->ssthresh = cc_reduce(cc,in_flight / 2);
+  cc->cwnd = cc->mss;
+  cc->bytes_acked = 0;
+}
+
+/*
+  Cube root by Newton's method, so that CUBIC does not need libm.
+*/
+static double cc_cbrt(double x)
+{
+  double r = (x > 1.0) ? x / 3.0 : 1.0;
+  int i;
+
+  if (x <= 0.0)
+  {
+    return 0.0;
+  }
+  for (i = 0; i < 40; i++)
+  {
+    r = r - (r * r * r - x) / (3.0 * r * r);
+  }
+  return r;
+}
+
+void cc_cubic_init(cc_state_t *cc, uint32_t mss)
+{
+  cc_newreno_init(cc,mss);
+}
+
+void cc_cubic_on_ack(cc_state_t *cc, uint32_t bytes_acked, long now)
+{
+  double cwnd_seg = (double)cc->cwnd / cc->mss;
+  double t;
+  double target;
+
+  if (cc->cwnd < cc->ssthresh)
+  {
+    cc_slow_start(cc,bytes_acked);
+    return;
+  }
+
+  if (cc->epoch_start == 0)
+  {
+    cc->epoch_start = now;
+    if (cwnd_seg < cc->w_max)
+    {
+      cc->k = cc_cbrt((cc->w_max - cwnd_seg) / CUBIC_C);
+      cc->origin_point = cc->w_max;
+    }
+    else
+    {
+      cc->k = 0;
+      cc->origin_point = cwnd_seg;
+    }
+    cc->w_est = cwnd_seg;
+  }
+
+  // W_cubic(t) = C * (t - K)^3 + W_max, t in seconds
+  t = (now - cc->epoch_start) / 1000.0 - cc->k;
+  target = cc->origin_point + CUBIC_C * t * t * t;
+
+  // Never grow slower than Reno would (RFC 8312, TCP-friendly region)
+  cc->w_est += 3.0 * (1.0 - CUBIC_BETA) / (1.0 + CUBIC_BETA) *
+               ((double)bytes_acked / cc->mss) / cwnd_seg;
+  if (target < cc->w_est)
+  {
+    target = cc->w_est;
+  }
+  // At most 1.5 * cwnd per RTT (RFC 8312 4.1), a long epoch would
+  // otherwise overflow the increment
+  if (target > 1.5 * cwnd_seg)
+  {
+    target = 1.5 * cwnd_seg;
+  }
+
+  if (target > cwnd_seg)
+  {
+    cc->growth += (target - cwnd_seg) * bytes_acked / cwnd_seg;
+  }
+  else
+  {
+    // On the plateau: 1 / (100 * cwnd) segments per ACK
+    cc->growth += bytes_acked / (100 * cwnd_seg);
+  }
+  cc->bytes_acked += (uint32_t)cc->growth;
+  cc->growth -= (uint32_t)cc->growth;
+  if (cc->bytes_acked >= cc->mss)
+  {
+    cc->cwnd += cc->bytes_acked - cc->bytes_acked % cc->mss;
+    cc->bytes_acked %= cc->mss;
+  }
+}
+
+void cc_cubic_on_loss(cc_state_t *cc, uint32_t in_flight, long now)
+{
+  double cwnd_seg = (double)cc->cwnd / cc->mss;
+
+  (void)in_flight;
+  (void)now;
+  // Fast convergence: give up bandwidth to newer flows
+  if (cwnd_seg < cc->w_max)
+  {
+    cc->w_max = cwnd_seg * (1.0 + CUBIC_BETA) / 2.0;
+  }
+  else
+  {
+    cc->w_max = cwnd_seg;
+  }
+  cc->epoch_start = 0;
+  cc->ssthresh = cc_reduce(cc,(uint32_t)(cc->cwnd * CUBIC_BETA));
+  cc->cwnd = cc->ssthresh;
+  cc->bytes_acked = 0;
+}
+
+void cc_cubic_on_rto(cc_state_t *cc, uint32_t in_flight, long now)
+{
+  cc_cubic_on_loss(cc,in_flight,now);
+  cc->cwnd = cc->mss;
+}
+
+void rtt_init(rtt_estimator_t *rtt, long rto, long rto_min, long rto_max)
+{
+  memset(rtt,0,sizeof(rtt_estimator_t));
+  rtt->rto_min = rto_min;
+  rtt->rto_max = rto_max;
+  rtt->rto = (rto < rto_min) ? rto_min : ((rto > rto_max) ? rto_max : rto);
+}
+
+void rtt_sample(rtt_estimator_t *rtt, long sample)
+{
+  long delta;
+
+  if (sample < 0)
+  {
+    return;
+  }
+  if (!rtt->has_sample)
+  {
+    rtt->srtt = sample << 3;
+    rtt->rttvar = sample << 1;
+    rtt->has_sample = true;
+  }
+  else
+  {
+    // SRTT += (R - SRTT) / 8, RTTVAR += (|R - SRTT| - RTTVAR) / 4
+    delta = sample - (rtt->srtt >> 3);
+    rtt->srtt += delta;
+    if (delta < 0)
+    {
+      delta = -delta;
+    }
+    rtt->rttvar += delta - (rtt->rttvar >> 2);
+  }
+
+  // RTO = SRTT + max(G, 4 * RTTVAR)
+  rtt->rto = (rtt->srtt >> 3) + ((rtt->rttvar > TIMER_INTERVAL) ? rtt->rttvar : TIMER_INTERVAL);
+  if (rtt->rto < rtt->rto_min)
+  {
+    rtt->rto = rtt->rto_min;
+  }
+  if (rtt->rto > rtt->rto_max)
+  {
+    rtt->rto = rtt->rto_max;
+  }
+}
+
+void rtt_backoff(rtt_estimator_t *rtt)
+{
+  rtt->rto <<= 1;
+  if (rtt->rto > rtt->rto_max)
+  {
+    rtt->rto = rtt->rto_max;
+  }
+}
+
+void timer_wheel_init(timer_wheel_t *wheel, long now)
+{
+  memset(wheel,0,sizeof(timer_wheel_t));
+  wheel->current = now / TIMER_WHEEL_TICK;
+  wheel->initialized = true;
+}
+
+/*
+  Arm "entry" to expire at "expires" (ms), re-arming it if it is already
+  pending. Deadlines in the past fire on the next tick.
+*/
+void timer_wheel_add(timer_wheel_t *wheel, timer_entry_t *entry, long expires)
+{
+  long tick = expires / TIMER_WHEEL_TICK;
+
+  timer_wheel_cancel(entry);
+  entry->expires = (tick <= wheel->current) ? wheel->current + 1 : tick;
+  timer_wheel_insert(wheel,entry);
+}
+
+/*
+  Link an unarmed entry into the slot of its deadline, relative to the
+  current tick.
+*/
+static void timer_wheel_insert(timer_wheel_t *wheel, timer_entry_t *entry)
+{
+  long tick = entry->expires;
+  long delta = tick - wheel->current;
+  int level = 0;
+  timer_entry_t **slot;
+
+  while (level < TIMER_WHEEL_LEVELS - 1 &&
+         delta >= (1L << (TIMER_WHEEL_BITS * (level + 1))))
+  {
+    level ++;
+  }
+  if (delta >= (1L << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)))
+  {
+    // Past the top level: park it in the farthest slot
+    tick = wheel->current + (1L << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+  }
+  entry->expires = tick;
+
+  slot = &wheel->slots[level][(tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+  entry->next = *slot;
+  if (*slot)
+  {
+    (*slot)->pprev = &entry->next;
+  }
+  *slot = entry;
+  entry->pprev = slot;
+}
+
+void timer_wheel_cancel(timer_entry_t *entry)
+{
+  if (entry->pprev == NULL)
+  {
+    return;
+  }
+  *entry->pprev = entry->next;
+  if (entry->next)
+  {
+    entry->next->pprev = entry->pprev;
+  }
+  entry->next = NULL;
+  entry->pprev = NULL;
+}
+
+/*
+  Move the entries of one upper level slot down to where they belong now.
+*/
+static void timer_wheel_cascade(timer_wheel_t *wheel, int level)
+{
+  timer_entry_t **slot = &wheel->slots[level][(wheel->current >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+  timer_entry_t *entry;
+
+  while ((entry = *slot) != NULL)
+  {
+    timer_wheel_cancel(entry);
+    timer_wheel_insert(wheel,entry);
+  }
+}
+
+void timer_wheel_advance(timer_wheel_t *wheel, long now)
+{
+  long target = now / TIMER_WHEEL_TICK;
+  timer_entry_t *expired;
+  timer_entry_t *entry;
+  int level;
+
+  while (wheel->current < target)
+  {
+    wheel->current ++;
+    for (level = TIMER_WHEEL_LEVELS - 1; level > 0; level--)
+    {
+      if ((wheel->current & ((1L << (TIMER_WHEEL_BITS * level)) - 1)) == 0)
+      {
+        timer_wheel_cascade(wheel,level);
+      }
+    }
+
+    // Detach the slot so that callbacks can re-arm or cancel freely
+    expired = wheel->slots[0][wheel->current & TIMER_WHEEL_MASK];
+    wheel->slots[0][wheel->current & TIMER_WHEEL_MASK] = NULL;
+    if (expired)
+    {
+      expired->pprev = &expired;
+    }
+    while ((entry = expired) != NULL)
+    {
+      timer_wheel_cancel(entry);
+      entry->expire(entry,now);
+    }
+  }
+}
+
+/*
+  ms until ctcp_timer() has something to do in the calling thread's shard:
+  the first non empty level 0 slot, or the next cascade from the levels
+  above, whichever comes first. Lets an event loop sleep exactly that long
+  so that short deadlines such as pacing are not rounded up to its tick.
+*/
+long ctcp_timer_next(void)
+{
+  timer_wheel_t *wheel = &ctcp_shard->timer_wheel;
+  long now = current_time();
+  long tick;
+  long cascade;
+
+  if (!wheel->initialized)
+  {
+    return TIMER_WHEEL_SLOTS * TIMER_WHEEL_TICK;
+  }
+  cascade = (wheel->current | TIMER_WHEEL_MASK) + 1;
+  for (tick = wheel->current + 1; tick < cascade; tick++)
+  {
+    if (wheel->slots[0][tick & TIMER_WHEEL_MASK] != NULL)
+    {
+      break;
+    }
+  }
+  tick = tick * TIMER_WHEEL_TICK - now;
+  return (tick > 0) ? tick : 0;
+}
+
+void pool_init(pool_t *pool, size_t object_size)
+{
+  memset(pool,0,sizeof(pool_t));
+  // Every object must be able to hold the free list link
+  if (object_size < sizeof(void*))
+  {
+    object_size = sizeof(void*);
+  }
+  pool->object_size = (object_size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+}
+
+/*
+  Zeroed object from the free list, grabbing a new slab when it is empty.
+*/
+void *pool_alloc(pool_t *pool)
+{
+  pool_slab_t *slab;
+  char *object;
+  unsigned int index;
+
+  if (pool->free_list == NULL)
+  {
+    slab = (pool_slab_t*)malloc(sizeof(pool_slab_t) + POOL_SLAB_OBJECTS * pool->object_size);
+    if (slab == NULL)
+    {
+      return NULL;
+    }
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    object = (char*)(slab + 1);
+    for (index = 0; index < POOL_SLAB_OBJECTS; index++)
+    {
+      *(void**)(object + index * pool->object_size) = pool->free_list;
+      pool->free_list = object + index * pool->object_size;
+    }
+  }
+
+  object = (char*)pool->free_list;
+  pool->free_list = *(void**)object;
+  pool->in_use ++;
+  memset(object,0,pool->object_size);
+  return object;
+}
+
+void pool_free(pool_t *pool, void *object)
+{
+  if (object == NULL)
+  {
+    return;
+  }
+  *(void**)object = pool->free_list;
+  pool->free_list = object;
+  pool->in_use --;
+}
+
+void pool_destroy(pool_t *pool)
+{
+  pool_slab_t *slab;
+
+  while ((slab = pool->slabs) != NULL)
+  {
+    pool->slabs = slab->next;
+    free(slab);
+  }
+  pool->free_list = NULL;
+  pool->in_use = 0;
+}
+
+/*
+  Segment of total length "len" from the smallest class it fits in.
+*/
+ctcp_segment_t *segment_alloc(ctcp_state_t *state, uint16_t len)
+{
+  if (len <= state->segment_pool[SEGMENT_CLASS_HEADER].object_size)
+  {
+    return (ctcp_segment_t*)pool_alloc(&state->segment_pool[SEGMENT_CLASS_HEADER]);
+  }
+  return (ctcp_segment_t*)pool_alloc(&state->segment_pool[SEGMENT_CLASS_FULL]);
+}
+
+void segment_free(ctcp_state_t *state, ctcp_segment_t *segment, uint16_t len)
+{
+  if (len <= state->segment_pool[SEGMENT_CLASS_HEADER].object_size)
+  {
+    pool_free(&state->segment_pool[SEGMENT_CLASS_HEADER],segment);
+    return;
+  }
+  pool_free(&state->segment_pool[SEGMENT_CLASS_FULL],segment);
+}
+
+/*
+  RFC 1624 incremental update: the checksum "cksum_old" of a segment in
+  which the "len" bytes at "old" are replaced by "new", both in network
+  order. HC' = ~(~HC + ~m + m'), len must be even.
+*/
+uint16_t cksum_update(uint16_t cksum_old, const void *old, const void *new, uint16_t len)
+{
+  const uint8_t *old_bytes = (const uint8_t*)old;
+  const uint8_t *new_bytes = (const uint8_t*)new;
+  uint32_t sum = (uint16_t)~ntohs(cksum_old);
+
+  for (; len >= 2; old_bytes += 2, new_bytes += 2, len -= 2)
+  {
+    sum += (uint16_t)~(old_bytes[0] << 8 | old_bytes[1]);
+    sum += new_bytes[0] << 8 | new_bytes[1];
+  }
+  while (sum > 0xffff)
+  {
+    sum = (sum >> 16) + (sum & 0xffff);
+  }
+  sum = htons((uint16_t)~sum);
+  // Same representation of zero as cksum()
+  return sum ? sum : 0xffff;
+}
+
+/*
+  One's complement sum kernels. Each returns the unfolded sum of the data
+  taken as 16-bit words in host byte order; by the byte order independence
+  of the Internet checksum (RFC 1071) folding that and complementing it
+  gives the same bytes as cksum() on the network order words.
+*/
+static inline uint64_t cksum_scalar(const uint8_t *data, size_t len)
+{
+  uint64_t sum = 0;
+  uint64_t word64;
+  uint32_t word32;
+  uint16_t word16;
+
+  while (len >= 8)
+  {
+    memcpy(&word64,data,sizeof(word64));
+    sum += (word64 & 0xffffffff) + (word64 >> 32);
+    data += 8;
+    len -= 8;
+  }
+  if (len >= 4)
+  {
+    memcpy(&word32,data,sizeof(word32));
+    sum += word32;
+    data += 4;
+    len -= 4;
+  }
+  if (len >= 2)
+  {
+    memcpy(&word16,data,sizeof(word16));
+    sum += word16;
+    data += 2;
+    len -= 2;
+  }
+  if (len > 0)
+  {
+    // Odd byte is the high half of a network order word. Added as a byte,
+    // a one byte store read back as a word would stall the load
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    sum += (uint32_t)data[0] << 8;
+#else
+    sum += data[0];
+#endif
+  }
+  return sum;
+}
+
+#if CKSUM_SIMD
+/* Lanes are widened to 32 bits and drained into the 64-bit sum before any
+   of them can overflow */
+#define CKSUM_SIMD_DRAIN 32768
+
+static uint64_t cksum_sse2(const uint8_t *data, size_t len)
+{
+  const __m128i zero = _mm_setzero_si128();
+  uint32_t lanes[4];
+  uint64_t sum = 0;
+  __m128i acc, block;
+  size_t count;
+
+  while (len >= 16)
+  {
+    acc = zero;
+    for (count = 0; len >= 16 && count < CKSUM_SIMD_DRAIN; count++)
+    {
+      block = _mm_loadu_si128((const __m128i*)data);
+      acc = _mm_add_epi32(acc,_mm_unpacklo_epi16(block,zero));
+      acc = _mm_add_epi32(acc,_mm_unpackhi_epi16(block,zero));
+      data += 16;
+      len -= 16;
+    }
+    _mm_storeu_si128((__m128i*)lanes,acc);
+    sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  }
+  return sum + cksum_scalar(data,len);
+}
+
+__attribute__((target("avx2")))
+static uint64_t cksum_avx2(const uint8_t *data, size_t len)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  uint32_t lanes[8];
+  uint64_t sum = 0;
+  __m256i acc, block;
+  size_t count;
+  int lane;
+
+  while (len >= 32)
+  {
+    acc = zero;
+    for (count = 0; len >= 32 && count < CKSUM_SIMD_DRAIN; count++)
+    {
+      block = _mm256_loadu_si256((const __m256i*)data);
+      acc = _mm256_add_epi32(acc,_mm256_unpacklo_epi16(block,zero));
+      acc = _mm256_add_epi32(acc,_mm256_unpackhi_epi16(block,zero));
+      data += 32;
+      len -= 32;
+    }
+    _mm256_storeu_si256((__m256i*)lanes,acc);
+    for (lane = 0; lane < 8; lane++)
+    {
+      sum += lanes[lane];
+    }
+  }
+  // Clear the upper halves first, SSE2 code after dirty 256-bit state
+  // pays a transition penalty on every instruction
+  _mm256_zeroupper();
+  return sum + cksum_sse2(data,len);
+}
+#endif
+
+/* Picked on the first call from what the CPU supports */
+static uint64_t (*cksum_kernel)(const uint8_t *data, size_t len);
+
+/* Fold a kernel's sum to 16 bits and complement it, zero as cksum() has it */
+static inline uint16_t cksum_finish(uint64_t sum)
+{
+  sum = (sum >> 32) + (sum & 0xffffffff);
+  while (sum > 0xffff)
+  {
+    sum = (sum >> 16) + (sum & 0xffff);
+  }
+  sum = (uint16_t)~sum;
+  return sum ? sum : 0xffff;
+}
+
+/*
+  Drop-in replacement for cksum(), same result bytes.
+*/
+uint16_t cksum_fast(const void *data, uint16_t len)
+{
+  if (cksum_kernel == NULL)
+  {
+    cksum_kernel = cksum_scalar;
+#if CKSUM_SIMD
+    cksum_kernel = cksum_sse2;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+      cksum_kernel = cksum_avx2;
+    }
+#endif
+  }
+
+  if (len < CKSUM_SHORT)
+  {
+    return cksum_finish(cksum_scalar((const uint8_t*)data,len));
+  }
+  return cksum_finish(cksum_kernel((const uint8_t*)data,len));
+}
+
+static uint32_t conn_table_hash(conn_table_t *table, conn_t *conn)
+{
+  // Fibonacci hashing, the low bits of a pointer carry little entropy
+  return (uint32_t)(((uint64_t)(uintptr_t)conn * 0x9E3779B97F4A7C15ull) >> 32) &
+         (table->num_buckets - 1);
+}
+
+static void conn_table_link(conn_table_t *table, ctcp_state_t *state)
+{
+  ctcp_state_t **bucket = &table->buckets[conn_table_hash(table,state->conn)];
+
+  state->next = *bucket;
+  state->prev = bucket;
+  if (*bucket)
+    (*bucket)->prev = &state->next;
+  *bucket = state;
+}
+
+/*
+  Double the bucket array and rehash, amortized O(1) per insert.
+*/
+static void conn_table_grow(conn_table_t *table)
+{
+  ctcp_state_t **old_buckets = table->buckets;
+  uint32_t old_num = table->num_buckets;
+  ctcp_state_t *state;
+  ctcp_state_t *next;
+  uint32_t index;
+
+  table->num_buckets = old_num ? old_num << 1 : CONN_TABLE_MIN_BUCKETS;
+  table->buckets = (ctcp_state_t**)calloc(table->num_buckets,sizeof(ctcp_state_t*));
+  for (index = 0; index < old_num; index++)
+  {
+    for (state = old_buckets[index]; state != NULL; state = next)
+    {
+      next = state->next;
+      conn_table_link(table,state);
+    }
+  }
+  free(old_buckets);
+}
+
+void conn_table_insert(conn_table_t *table, ctcp_state_t *state)
+{
+  if (table->num_states >= table->num_buckets)
+  {
+    conn_table_grow(table);
+  }
+  conn_table_link(table,state);
+  table->num_states ++;
+}
+
+void conn_table_remove(conn_table_t *table, ctcp_state_t *state)
+{
+  if (state->next)
+    state->next->prev = state->prev;
+  *state->prev = state->next;
+  table->num_states --;
+}
+
+ctcp_state_t *conn_table_lookup(conn_table_t *table, conn_t *conn)
+{
+  ctcp_state_t *state;
+
+  if (table->num_buckets == 0)
+  {
+    return NULL;
+  }
+  for (state = table->buckets[conn_table_hash(table,conn)]; state != NULL; state = state->next)
+  {
+    if (state->conn == conn)
+    {
+      return state;
+    }
+  }
+  return NULL;
+}
+
+/*
+  Queue a segment in wire format for the next flush. A pure ACK queued
+  again replaces the previous one, which it supersedes.
+*/
+void ctcp_tx_queue(ctcp_state_t *state, ctcp_segment_t *segment, size_t len)
+{
+  tx_batch_t *batch = &state->tx_batch;
+  int index;
+
+  if (segment == state->ack_segment)
+  {
+    for (index = 0; index < batch->count; index++)
+    {
+      if (batch->segments[index] == segment)
+      {
+        batch->lens[index] = len;
+        return;
+      }
+    }
+  }
+  if (batch->count == TX_BATCH_MAX)
+  {
+    ctcp_tx_flush(state);
+  }
+  if (batch->count == 0)
+  {
+    batch->next = state->shard->tx_pending;
+    batch->prev = &state->shard->tx_pending;
+    if (batch->next)
+      batch->next->tx_batch.prev = &batch->next;
+    state->shard->tx_pending = state;
+  }
+  batch->segments[batch->count] = segment;
+  batch->lens[batch->count] = len;
+  batch->count ++;
+}
+
+void ctcp_tx_flush(ctcp_state_t *state)
+{
+  tx_batch_t *batch = &state->tx_batch;
+  int index;
+  int sent = 0;
+
+  if (batch->count == 0)
+  {
+    return;
+  }
+
+  if (conn_send_batch != NULL)
+  {
+    sent = conn_send_batch(state->conn,batch->segments,batch->lens,batch->count);
+    batch->send_calls ++;
+  }
+  // No batch call, or it stopped early: the rest one by one
+  for (index = (sent > 0) ? sent : 0; index < batch->count; index++)
+  {
+    conn_send(state->conn,batch->segments[index],batch->lens[index]);
+    batch->send_calls ++;
+  }
+
+  batch->batches ++;
+  batch->segments_sent += batch->count;
+  if (batch->count > batch->largest)
+  {
+    batch->largest = batch->count;
+  }
+  batch->count = 0;
+  if (batch->next)
+    batch->next->tx_batch.prev = batch->prev;
+  *batch->prev = batch->next;
+}
+
+void ctcp_tx_flush_all(void)
+{
+  while (ctcp_shard->tx_pending != NULL)
+  {
+    ctcp_tx_flush(ctcp_shard->tx_pending);
+  }
+}
+
+/*
+  A shard of its own for one worker thread, with the timer wheel started
+  so that ctcp_timer() can run before the first connection exists.
+*/
+ctcp_shard_t *ctcp_shard_create(int id)
+{
+  ctcp_shard_t *shard = calloc(sizeof(ctcp_shard_t),1);
+
+  if (shard == NULL)
+  {
+    return NULL;
+  }
+  shard->id = id;
+  timer_wheel_init(&shard->timer_wheel,current_time());
+  return shard;
+}
+
+/* Every connection of the shard must have been destroyed already */
+void ctcp_shard_destroy(ctcp_shard_t *shard)
+{
+  if (shard == NULL || shard == &ctcp_shard_default)
+  {
+    return;
+  }
+  if (ctcp_shard == shard)
+  {
+    ctcp_shard = &ctcp_shard_default;
+  }
+  free(shard->conn_table.buckets);
+  free(shard);
+}
+
+/*
+  Make "shard" the one the calling thread works in: connections created by
+  ctcp_init() from now on belong to it and ctcp_timer() drives its wheel.
+  NULL goes back to the default shard.
+*/
+void ctcp_shard_enter(ctcp_shard_t *shard)
+{
+  ctcp_shard = shard ? shard : &ctcp_shard_default;
+}
+
+void hist_record(hist_t *hist, uint64_t value)
+{
+  unsigned int index, shift;
+
+  if (value > 0xffffffffu)
+  {
+    value = 0xffffffffu;
+  }
+  // Exact below 2 * HIST_SUB, then HIST_SUB buckets per power of 2
+  if (value < 2 * HIST_SUB)
+  {
+    index = value;
+  }
+  else
+  {
+    shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    index = (shift + 1) * HIST_SUB + (value >> shift) - HIST_SUB;
+  }
+  hist->counts[index] ++;
+  if (hist->count == 0 || value < hist->min)
+  {
+    hist->min = value;
+  }
+  if (value > hist->max)
+  {
+    hist->max = value;
+  }
+  hist->count ++;
+  hist->sum += value;
+}
+
+/* Highest value that falls into bucket "index" */
+static uint64_t hist_bucket_value(unsigned int index)
+{
+  unsigned int shift;
+
+  if (index < 2 * HIST_SUB)
+  {
+    return index;
+  }
+  shift = index / HIST_SUB - 1;
+  return ((uint64_t)(index % HIST_SUB + HIST_SUB) << shift) + ((1ULL << shift) - 1);
+}
+
+void hist_merge(hist_t *into, const hist_t *from)
+{
+  unsigned int index;
+
+  if (from->count == 0)
+  {
+    return;
+  }
+  for (index = 0; index < HIST_BUCKETS; index++)
+  {
+    into->counts[index] += from->counts[index];
+  }
+  if (into->count == 0 || from->min < into->min)
+  {
+    into->min = from->min;
+  }
+  if (from->max > into->max)
+  {
+    into->max = from->max;
+  }
+  into->count += from->count;
+  into->sum += from->sum;
+}
+
+uint64_t hist_value_at(const hist_t *hist, double percentile)
+{
+  uint64_t target = (uint64_t)(hist->count * percentile / 100.0 + 0.5);
+  uint64_t seen = 0;
+  unsigned int index;
+
+  if (hist->count == 0)
+  {
+    return 0;
+  }
+  if (target == 0)
+  {
+    target = 1;
+  }
+  for (index = 0; index < HIST_BUCKETS; index++)
+  {
+    seen += hist->counts[index];
+    if (seen >= target)
+    {
+      break;
+    }
+  }
+  return (hist_bucket_value(index) < hist->max) ? hist_bucket_value(index) : hist->max;
+}
+
+/* Window limited time so far, the interval still open included */
+static uint64_t ctcp_stats_window_limited(const ctcp_stats_t *stats)
+{
+  if (stats->window_limited_since == 0)
+  {
+    return stats->window_limited_ms;
+  }
+  return stats->window_limited_ms + (current_time() - stats->window_limited_since);
+}
+
+void ctcp_stats_add(ctcp_stats_t *total, const ctcp_stats_t *stats)
+{
+  total->bytes_sent += stats->bytes_sent;
+  total->bytes_retransmitted += stats->bytes_retransmitted;
+  total->bytes_delivered += stats->bytes_delivered;
+  total->segments_sent += stats->segments_sent;
+  total->segments_retransmitted += stats->segments_retransmitted;
+  total->acks_sent += stats->acks_sent;
+  total->segments_received += stats->segments_received;
+  total->duplicates += stats->duplicates;
+  total->out_of_order += stats->out_of_order;
+  total->cksum_failures += stats->cksum_failures;
+  total->window_limited_ms += ctcp_stats_window_limited(stats);
+  hist_merge(&total->rtt,&stats->rtt);
+  hist_merge(&total->ack_latency,&stats->ack_latency);
+}
+
+static void hist_print(FILE *out, const char *name, const hist_t *hist)
+{
+  fprintf(out,"\"%s\": {\"count\": %llu, \"min\": %llu, \"mean\": %.1f, \"p50\": %llu, "
+          "\"p90\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}",name,
+          (unsigned long long)hist->count,(unsigned long long)hist->min,
+          hist->count ? (double)hist->sum / hist->count : 0.0,
+          (unsigned long long)hist_value_at(hist,50),(unsigned long long)hist_value_at(hist,90),
+          (unsigned long long)hist_value_at(hist,99),(unsigned long long)hist_value_at(hist,99.9),
+          (unsigned long long)hist->max);
+}
+
+/* One JSON object, no trailing newline */
+void ctcp_stats_print(FILE *out, const ctcp_stats_t *stats)
+{
+  fprintf(out,"{\"bytes_sent\": %llu, \"bytes_retransmitted\": %llu, \"bytes_delivered\": %llu, "
+          "\"segments_sent\": %llu, \"segments_retransmitted\": %llu, \"acks_sent\": %llu, "
+          "\"segments_received\": %llu, \"duplicates\": %llu, \"out_of_order\": %llu, "
+          "\"cksum_failures\": %llu, \"window_limited_ms\": %llu, ",
+          (unsigned long long)stats->bytes_sent,(unsigned long long)stats->bytes_retransmitted,
+          (unsigned long long)stats->bytes_delivered,(unsigned long long)stats->segments_sent,
+          (unsigned long long)stats->segments_retransmitted,(unsigned long long)stats->acks_sent,
+          (unsigned long long)stats->segments_received,(unsigned long long)stats->duplicates,
+          (unsigned long long)stats->out_of_order,(unsigned long long)stats->cksum_failures,
+          (unsigned long long)ctcp_stats_window_limited(stats));
+  hist_print(out,"rtt_us",&stats->rtt);
+  fprintf(out,", ");
+  hist_print(out,"ack_latency_us",&stats->ack_latency);
+  fprintf(out,"}");
+}
+
+/*
+  Every connection of the calling thread's shard, then their sum, as one
+  line of JSON.
+*/
+void ctcp_stats_dump(FILE *out)
+{
+  conn_table_t *table = &ctcp_shard->conn_table;
+  ctcp_stats_t *total = calloc(sizeof(ctcp_stats_t),1);
+  ctcp_state_t *state;
+  uint32_t bucket;
+  bool first = true;
+
+  if (total == NULL)
+  {
+    return;
+  }
+  fprintf(out,"{\"shard\": %d, \"connections\": [",ctcp_shard->id);
+  for (bucket = 0; bucket < table->num_buckets; bucket++)
+  {
+    for (state = table->buckets[bucket]; state != NULL; state = state->next)
+    {
+      fprintf(out,first ? "" : ", ");
+      ctcp_stats_print(out,&state->stats);
+      ctcp_stats_add(total,&state->stats);
+      first = false;
+    }
+  }
+  fprintf(out,"], \"total\": ");
+  ctcp_stats_print(out,total);
+  fprintf(out,"}\n");
+  fflush(out);
+  free(total);
+}
+
+#if STATS_SIGNAL
+static void ctcp_stats_signal(int signo)
+{
+  (void)signo;
+  stats_requests ++;
+}
+#endif
+
+/* Install the STATS_SIGNAL handler, once per process */
+void ctcp_stats_signal_init(void)
+{
+#if STATS_SIGNAL
+  static bool installed;
+  struct sigaction action;
+
+  if (installed)
+  {
+    return;
+  }
+  installed = true;
+  memset(&action,0,sizeof(action));
+  action.sa_handler = ctcp_stats_signal;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  sigaction(STATS_SIGNAL,&action,NULL);
+#endif
+}
+
+/* Cheapest monotonic clock around: the TSC on x86, ns elsewhere */
+static inline uint64_t trace_clock(void)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+  return __rdtsc();
+#else
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC,&now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+#if TRACE_ENABLE
+static inline void trace_event(trace_ring_t *ring, const void *state, uint16_t event,
+                               uint32_t seqno, uint32_t ackno, uint32_t len)
+{
+  trace_record_t *record = &ring->records[ring->head & (TRACE_RING_SIZE - 1)];
+
+  if (ring->head == 0)
+  {
+    ring->start_ticks = trace_clock();
+    ring->start_us = ctcp_clock_us();
+  }
+  record->ticks = trace_clock();
+  record->seqno = seqno;
+  record->ackno = ackno;
+  record->len = (len > 0xffff) ? 0xffff : len;
+  record->event = event;
+  record->conn = (uint32_t)(uintptr_t)state;
+  ring->head ++;
+}
+#endif
+
+/*
+  Write the calling thread's trace ring to "out", header first, then the
+  records it still holds from oldest to newest.
+*/
+void ctcp_trace_dump(FILE *out)
+{
+#if TRACE_ENABLE
+  trace_ring_t *ring = &ctcp_shard->trace;
+  trace_header_t header;
+  uint64_t first;
+  uint32_t index;
+
+  header.magic = TRACE_MAGIC;
+  header.count = (ring->head < TRACE_RING_SIZE) ? ring->head : TRACE_RING_SIZE;
+  header.start_ticks = ring->start_ticks;
+  header.start_us = ring->start_us;
+  header.end_ticks = trace_clock();
+  header.end_us = ctcp_clock_us();
+  fwrite(&header,sizeof(header),1,out);
+
+  first = ring->head - header.count;
+  for (index = 0; index < header.count; index++)
+  {
+    fwrite(&ring->records[(first + index) & (TRACE_RING_SIZE - 1)],sizeof(trace_record_t),1,out);
+  }
+  fflush(out);
+#else
+  (void)out;
+#endif
+}
+
+#if SHARD_RUNTIME
+typedef struct shard_worker{
+  pthread_t thread;
+  int id;
+  int cpu;
+  void (*run)(int id, void *arg);
+  void *arg;
+}shard_worker_t;
+
+/*
+  UDP socket on "port" with SO_REUSEPORT, one per worker. The kernel hashes
+  each 4-tuple to one socket of the group, so every datagram of a flow
+  reaches the same worker and thus the shard that holds its connection.
+  Non blocking, returns -1 on failure.
+*/
+int ctcp_shard_socket(uint16_t port)
+{
+  struct sockaddr_in addr;
+  int fd = socket(AF_INET,SOCK_DGRAM | SOCK_NONBLOCK,0);
+  int one = 1;
+  int size = 4 << 20;
+
+  if (fd < 0)
+  {
+    return -1;
+  }
+  memset(&addr,0,sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  // Room for a few windows of every connection the worker holds
+  setsockopt(fd,SOL_SOCKET,SO_RCVBUF,&size,sizeof(size));
+  setsockopt(fd,SOL_SOCKET,SO_SNDBUF,&size,sizeof(size));
+  if (setsockopt(fd,SOL_SOCKET,SO_REUSEPORT,&one,sizeof(one)) < 0 ||
+      bind(fd,(struct sockaddr*)&addr,sizeof(addr)) < 0)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void *shard_worker_main(void *arg)
+{
+  shard_worker_t *worker = (shard_worker_t*)arg;
+  ctcp_shard_t *shard;
+  cpu_set_t cpus;
+
+  CPU_ZERO(&cpus);
+  CPU_SET(worker->cpu,&cpus);
+  pthread_setaffinity_np(pthread_self(),sizeof(cpus),&cpus);
+
+  // Created after pinning, so the shard's memory is local to its core
+  shard = ctcp_shard_create(worker->id);
+  if (shard == NULL)
+  {
+    return NULL;
+  }
+  ctcp_shard_enter(shard);
+  worker->run(worker->id,worker->arg);
+  ctcp_shard_destroy(shard);
+  return NULL;
+}
+
+/*
+  Sharded runtime: "workers" threads (one per online core if <= 0), each
+  pinned to its own core and running run(id, arg) inside a shard of its
+  own. run() is the worker's event loop: it opens its socket with
+  ctcp_shard_socket(), creates its connections, feeds them through
+  ctcp_receive_batch() and calls ctcp_timer() every tick. Returns once
+  every worker has finished, with the number of workers started.
+*/
+int ctcp_shard_run(int workers, void (*run)(int id, void *arg), void *arg)
+{
+  shard_worker_t worker[SHARD_MAX_WORKERS];
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  char probe = 0;
+  int index, started = 0;
+
+  if (cores < 1)
+  {
+    cores = 1;
+  }
+  if (workers <= 0)
+  {
+    workers = (int)cores;
+  }
+  if (workers > SHARD_MAX_WORKERS)
+  {
+    workers = SHARD_MAX_WORKERS;
+  }
+  // Pick the checksum kernel now, the workers only ever read it
+  cksum_fast(&probe,1);
+  ctcp_stats_signal_init();
+
+  for (index = 0; index < workers; index++)
+  {
+    worker[index].id = index;
+    worker[index].cpu = index % cores;
+    worker[index].run = run;
+    worker[index].arg = arg;
+    if (pthread_create(&worker[index].thread,NULL,shard_worker_main,&worker[index]) != 0)
+    {
+      break;
+    }
+    started ++;
+  }
+  for (index = 0; index < started; index++)
+  {
+    pthread_join(worker[index].thread,NULL);
+  }
+  return started;
+}
+#endif
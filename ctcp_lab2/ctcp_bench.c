@@ -0,0 +1,493 @@
+/******************************************************************************
+ * ctcp_bench.c
+ * ------------
+ * Microbenchmarks for the hot paths of ctcp.c, which is compiled in here
+ * so that its internal functions can be driven directly. Build and run
+ * with "make bench".
+ *
+ *****************************************************************************/
+
+#include "ctcp.c"
+#include <sched.h>
+
+/**
+ * Microbenchmarks
+ *
+ * Linked against ctcp_utils.c and ctcp_linked_list.c instead of
+ * ctcp_sys.c, with the linker wrapping malloc(), calloc(), realloc() and
+ * current_time() (see the bench rule of the Makefile). The conn_*()
+ * calls below discard what is sent, the allocation wrappers count every
+ * call made from cTCP, and current_time() is a virtual clock that only
+ * the ctcp_timer benchmark moves, one TIMER_WHEEL_TICK per op, so that
+ * retransmission and persist deadlines come due during the run. Every
+ * benchmark runs on one pinned CPU (argv[1], default 0), is warmed up,
+ * then timed MICROBENCH_ROUNDS times; the median is reported as ns/op,
+ * allocations/op and MB/s or ops/s, one JSON document on stdout.
+ */
+#define MICROBENCH_ROUNDS 5
+#define MICROBENCH_OPS 200000
+#define MICROBENCH_WINDOW_MAX 256   /* Deepest send_sliding_window, sizes the data buffer */
+
+struct conn{
+  ctcp_state_t *state;      /* NULL once conn_remove()d */
+  uint64_t input_left;
+};
+
+static uint64_t micro_allocs;
+static bool micro_first = true;
+static long micro_now = 1;      /* Virtual clock, ms, moved by micro_timer() only */
+static bool micro_keepalive;    /* Forget resends, see conn_send() */
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+  micro_allocs ++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+  micro_allocs ++;
+  return __real_calloc(count,size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+  micro_allocs ++;
+  return __real_realloc(ptr,size);
+}
+
+long __wrap_current_time(void)
+{
+  return micro_now;
+}
+
+int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len)
+{
+  ll_node_t *node;
+
+  (void)segment;
+  // Nothing answers a benchmark connection, it would close after
+  // MAX_NUM_XMITS resends and leave the timer benchmark with less to do
+  if (micro_keepalive && conn->state != NULL &&
+      (node = ll_front(conn->state->linked_list_unack_segment)) != NULL)
+  {
+    ((unack_segment_t*)node->object)->num_retransmit = 0;
+  }
+  return len;
+}
+
+int conn_input(conn_t *conn, void *buf, size_t len)
+{
+  if (conn->input_left == 0)
+  {
+    return -1;
+  }
+  if (len > conn->input_left)
+  {
+    len = conn->input_left;
+  }
+  memset(buf,'x',len);
+  conn->input_left -= len;
+  return len;
+}
+
+int conn_output(conn_t *conn, const char *buf, size_t len)
+{
+  (void)conn; (void)buf;
+  return len;
+}
+
+size_t conn_bufspace(conn_t *conn)
+{
+  (void)conn;
+  return 1 << 20;
+}
+
+void conn_remove(conn_t *conn)
+{
+  conn->state = NULL;
+}
+
+void end_client()
+{
+}
+
+static double micro_ns(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC,&now);
+  return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+static int micro_compare(const void *a, const void *b)
+{
+  double x = *(const double*)a, y = *(const double*)b;
+
+  return (x > y) - (x < y);
+}
+
+/*
+  Warm up, then time "ops" operations of body() MICROBENCH_ROUNDS times
+  and print the median as one JSON result.
+*/
+static void micro_run(const char *name, const char *param_name, uint64_t param,
+                      void (*body)(void *arg, uint64_t ops), void *arg,
+                      uint64_t ops, uint64_t bytes_per_op)
+{
+  double times[MICROBENCH_ROUNDS];
+  uint64_t allocs = micro_allocs;
+  double start, ns;
+  int round;
+
+  body(arg,ops / 10 + 1);
+  allocs = micro_allocs;
+  for (round = 0; round < MICROBENCH_ROUNDS; round++)
+  {
+    start = micro_ns();
+    body(arg,ops);
+    times[round] = micro_ns() - start;
+  }
+  allocs = micro_allocs - allocs;
+  qsort(times,MICROBENCH_ROUNDS,sizeof(double),micro_compare);
+  ns = times[MICROBENCH_ROUNDS / 2] / ops;
+
+  printf("%s    {\"name\": \"%s\", \"%s\": %llu, \"ops\": %llu, \"ns_per_op\": %.2f, "
+         "\"allocs_per_op\": %.4f, \"ops_per_s\": %.0f, \"mb_per_s\": %.1f}",
+         micro_first ? "" : ",\n",name,param_name,(unsigned long long)param,
+         (unsigned long long)ops,ns,(double)allocs / ((double)ops * MICROBENCH_ROUNDS),
+         1e9 / ns,bytes_per_op * 1e3 / ns);
+  micro_first = false;
+  fflush(stdout);
+}
+
+static ctcp_state_t *micro_connection(conn_t *conn, uint64_t input)
+{
+  static ctcp_config_t config = {0xffff, 0xffff, 10, 200};
+
+  conn->input_left = input;
+  conn->state = ctcp_init(conn,&config);
+  return conn->state;
+}
+
+typedef struct micro_buffer{
+  uint8_t *data;
+  uint16_t len;
+}micro_buffer_t;
+
+static volatile uint16_t micro_sink;
+
+static void micro_cksum(void *arg, uint64_t ops)
+{
+  micro_buffer_t *buffer = (micro_buffer_t*)arg;
+
+  while (ops--)
+  {
+    micro_sink += cksum(buffer->data,buffer->len);
+  }
+}
+
+static void micro_cksum_fast(void *arg, uint64_t ops)
+{
+  micro_buffer_t *buffer = (micro_buffer_t*)arg;
+
+  while (ops--)
+  {
+    micro_sink += cksum_fast(buffer->data,buffer->len);
+  }
+}
+
+/*
+  Every cksum_fast() kernel the CPU runs, and cksum_fast() itself, against
+  cksum() on 1 B to 64 KiB, odd lengths and unaligned starts included.
+  False on the first mismatch, reported on stderr.
+*/
+static bool micro_cksum_check(const uint8_t *data)
+{
+  static const uint16_t sizes[] = {1, 2, 3, 8, 20, 63, 64, 100, 256, 1024, 1400,
+                                   4096, 16384, 32768, 65535};
+  static const struct {
+    const char *name;
+    uint64_t (*kernel)(const uint8_t *data, size_t len);
+  } kernels[] = {
+    {"scalar", cksum_scalar},
+#if CKSUM_SIMD
+    {"sse2", cksum_sse2},
+    {"avx2", cksum_avx2},
+#endif
+  };
+  unsigned int size_index, kernel_index, offset;
+  uint16_t len, expected;
+  bool ok = true;
+
+#if CKSUM_SIMD
+  __builtin_cpu_init();
+#endif
+  for (size_index = 0; size_index < sizeof(sizes) / sizeof(sizes[0]); size_index++)
+  {
+    for (offset = 0; offset < 2; offset++)
+    {
+      len = sizes[size_index] - offset;
+      expected = cksum(data + offset,len);
+      if (cksum_fast(data + offset,len) != expected)
+      {
+        fprintf(stderr,"cksum %5u B +%u %-6s MISMATCH\n",len,offset,"fast");
+        ok = false;
+      }
+      for (kernel_index = 0; kernel_index < sizeof(kernels) / sizeof(kernels[0]); kernel_index++)
+      {
+#if CKSUM_SIMD
+        if (kernels[kernel_index].kernel == cksum_avx2 && !__builtin_cpu_supports("avx2"))
+        {
+          continue;
+        }
+#endif
+        if (cksum_finish(kernels[kernel_index].kernel(data + offset,len)) != expected)
+        {
+          fprintf(stderr,"cksum %5u B +%u %-6s MISMATCH\n",len,offset,
+                  kernels[kernel_index].name);
+          ok = false;
+        }
+      }
+    }
+  }
+  return ok;
+}
+
+static void micro_segment_order(void *arg, uint64_t ops)
+{
+  ctcp_segment_t *segment = (ctcp_segment_t*)arg;
+
+  while (ops--)
+  {
+    segment_hton(segment);
+    __asm__ __volatile__("" : : "r"(segment) : "memory");
+    segment_ntoh(segment);
+    __asm__ __volatile__("" : : "r"(segment) : "memory");
+  }
+}
+
+static void micro_generate(void *arg, uint64_t ops)
+{
+  ctcp_state_t *state = (ctcp_state_t*)arg;
+  unack_segment_t unack;
+  ctcp_segment_t *segment;
+
+  memset(&unack,0,sizeof(unack));
+  unack.seqno = state->send.nextseqnum;
+  unack.data_len = MAX_SEG_DATA_SIZE;
+  unack.flags = ACK;
+  while (ops--)
+  {
+    segment = generate_data_segment(state,&unack);
+    segment_free(state,segment,ntohs(segment->len));
+  }
+}
+
+typedef struct micro_window{
+  ctcp_state_t *state;
+  uint32_t depth;           /* Segments per window */
+  char *data;
+}micro_window_t;
+
+/* Fill the window, send it, ACK it; one op is one segment */
+static void micro_sliding_window(void *arg, uint64_t ops)
+{
+  micro_window_t *window = (micro_window_t*)arg;
+  ctcp_state_t *state = window->state;
+  uint64_t rounds = ops / window->depth + 1;
+  uint32_t ackno;
+
+  while (rounds--)
+  {
+    send_ring_write(&state->send_ring,window->data,window->depth * MAX_SEG_DATA_SIZE);
+    ctcp_send_sliding_window(state);
+    ctcp_tx_flush(state);
+    ackno = state->send.nextseqnum;
+    ctcp_release_acked_segments(state,ackno);
+    state->send.send_base = ackno;
+    send_ring_release(&state->send_ring,ackno);
+  }
+}
+
+typedef struct micro_reorder{
+  recv_ring_t ring;
+  uint32_t order[64];       /* Arrival order of the 64 segments of a window */
+  uint32_t base;
+  char data[MAX_SEG_DATA_SIZE];
+}micro_reorder_t;
+
+/* One op is one segment placed in the receive ring */
+static void micro_recv_insert(void *arg, uint64_t ops)
+{
+  micro_reorder_t *reorder = (micro_reorder_t*)arg;
+  recv_ring_t *ring = &reorder->ring;
+  uint64_t op;
+  char *data;
+  uint32_t len;
+
+  for (op = 0; op < ops; op++)
+  {
+    recv_ring_insert(ring,reorder->base + reorder->order[op & 63] * MAX_SEG_DATA_SIZE,
+                     reorder->data,MAX_SEG_DATA_SIZE);
+    if ((op & 63) == 63)
+    {
+      while ((len = recv_ring_readable(ring,&data)) > 0)
+      {
+        recv_ring_consume(ring,len);
+      }
+      // Start every window clean even if a range was dropped
+      reorder->base += 64 * MAX_SEG_DATA_SIZE;
+      ring->read_seqno = ring->next_seqno = reorder->base;
+      ring->num_ranges = 0;
+    }
+  }
+}
+
+/* One op is one tick of the virtual clock, so deadlines come due */
+static void micro_timer(void *arg, uint64_t ops)
+{
+  (void)arg;
+  while (ops--)
+  {
+    micro_now += TIMER_WHEEL_TICK;
+    ctcp_timer();
+  }
+}
+
+int main(int argc, char **argv)
+{
+  static const uint16_t cksum_sizes[] = {1, 20, 40, 64, 256, 576, 1460, 4096, 16384, 65535};
+  static const uint32_t depths[] = {1, 4, 16, 64, MICROBENCH_WINDOW_MAX};
+  static const uint32_t degrees[] = {1, 4, 16, 64};
+  static const uint32_t conn_counts[] = {1, 16, 256, 1024};
+  int cpu = (argc > 1) ? atoi(argv[1]) : 0;
+  uint32_t seed = 2463534242u;
+  micro_buffer_t buffer;
+  micro_window_t window;
+  micro_reorder_t *reorder;
+  ctcp_segment_t segment;
+  conn_t *conns;
+  conn_t conn;
+  cpu_set_t cpus;
+  unsigned int index, count, slot, swap;
+  uint32_t tmp;
+
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu,&cpus);
+  if (sched_setaffinity(0,sizeof(cpus),&cpus) != 0)
+  {
+    cpu = -1;
+  }
+
+  // A whole window is written out of it at once
+  buffer.data = malloc(MICROBENCH_WINDOW_MAX * MAX_SEG_DATA_SIZE);
+  for (index = 0; index < MICROBENCH_WINDOW_MAX * MAX_SEG_DATA_SIZE; index++)
+  {
+    buffer.data[index] = (uint8_t)(index * 2654435761u >> 13);
+  }
+  // Timing a kernel that gets the sum wrong is pointless
+  if (!micro_cksum_check(buffer.data))
+  {
+    return 1;
+  }
+  printf("{\"bench\": \"micro\", \"cpu\": %d, \"rounds\": %d, \"results\": [\n",
+         cpu,MICROBENCH_ROUNDS);
+
+  for (index = 0; index < sizeof(cksum_sizes) / sizeof(cksum_sizes[0]); index++)
+  {
+    buffer.len = cksum_sizes[index];
+    micro_run("cksum","bytes",buffer.len,micro_cksum,&buffer,MICROBENCH_OPS,buffer.len);
+    micro_run("cksum_fast","bytes",buffer.len,micro_cksum_fast,&buffer,MICROBENCH_OPS,buffer.len);
+  }
+
+  memset(&segment,0,sizeof(segment));
+  segment.seqno = 1;
+  segment.len = sizeof(ctcp_segment_t);
+  micro_run("segment_hton_ntoh","bytes",sizeof(segment),micro_segment_order,&segment,
+            MICROBENCH_OPS * 10,sizeof(segment));
+
+  micro_connection(&conn,MAX_SEG_DATA_SIZE);
+  ctcp_read(conn.state);
+  ctcp_tx_flush(conn.state);
+  micro_run("generate_data_segment","bytes",MAX_SEG_DATA_SIZE,micro_generate,conn.state,
+            MICROBENCH_OPS,MAX_SEG_DATA_SIZE);
+  ctcp_destroy(conn.state);
+
+  window.data = (char*)buffer.data;
+  for (index = 0; index < sizeof(depths) / sizeof(depths[0]); index++)
+  {
+    window.depth = depths[index];
+    window.state = micro_connection(&conn,0);
+    ctcp_set_windows(window.state,window.state->recv_window,window.depth * MAX_SEG_DATA_SIZE);
+    window.state->cc.cwnd = window.depth * MAX_SEG_DATA_SIZE;
+    window.state->peer_window = window.depth * MAX_SEG_DATA_SIZE;
+    window.state->check_send_FIN = true; // No FIN after the ring drains
+    micro_run("send_sliding_window","depth",window.depth,micro_sliding_window,&window,
+              MICROBENCH_OPS,MAX_SEG_DATA_SIZE);
+    ctcp_destroy(window.state);
+  }
+
+  reorder = calloc(sizeof(micro_reorder_t),1);
+  for (index = 0; index < sizeof(degrees) / sizeof(degrees[0]); index++)
+  {
+    // Shuffled within blocks of "degree" segments, same seed every run
+    for (slot = 0; slot < 64; slot++)
+    {
+      reorder->order[slot] = slot;
+    }
+    for (slot = 0; slot < 64; slot++)
+    {
+      seed ^= seed << 13;
+      seed ^= seed >> 17;
+      seed ^= seed << 5;
+      swap = slot - slot % degrees[index] + seed % (degrees[index] - slot % degrees[index]);
+      tmp = reorder->order[slot];
+      reorder->order[slot] = reorder->order[swap];
+      reorder->order[swap] = tmp;
+    }
+    recv_ring_init(&reorder->ring,64 * MAX_SEG_DATA_SIZE,1);
+    reorder->base = 1;
+    micro_run("recv_ring_insert","reorder",degrees[index],micro_recv_insert,reorder,
+              MICROBENCH_OPS,MAX_SEG_DATA_SIZE);
+    free(reorder->ring.buf);
+  }
+  free(reorder);
+
+  for (index = 0; index < sizeof(conn_counts) / sizeof(conn_counts[0]); index++)
+  {
+    // Every other connection has data in flight and its RTO armed, the
+    // rest find the peer window shut and probe it
+    conns = calloc(sizeof(conn_t),conn_counts[index]);
+    for (count = 0; count < conn_counts[index]; count++)
+    {
+      micro_connection(&conns[count],100);
+      if (count & 1)
+      {
+        conns[count].state->peer_window = 0;
+      }
+      ctcp_read(conns[count].state);
+    }
+    ctcp_timer();
+    micro_keepalive = true;
+    micro_run("ctcp_timer","connections",conn_counts[index],micro_timer,NULL,
+              MICROBENCH_OPS,0);
+    micro_keepalive = false;
+    for (count = 0; count < conn_counts[index]; count++)
+    {
+      if (conns[count].state != NULL)
+      {
+        ctcp_destroy(conns[count].state);
+      }
+    }
+    free(conns);
+  }
+
+  printf("\n]}\n");
+  free(buffer.data);
+  return 0;
+}
@@ -0,0 +1,511 @@
+/******************************************************************************
+ * ctcp_linksim.c
+ * --------------
+ * Runs two cTCP endpoints against each other over a simulated lossy link,
+ * with ctcp.c compiled in. Build with "make linksim".
+ *
+ *****************************************************************************/
+
+#include "ctcp.c"
+
+/**
+ * Lossy link simulator
+ *
+ * Linked against ctcp_linked_list.c only: this file provides
+ * current_time() and the conn_*() calls in place of ctcp_utils.c and
+ * ctcp_sys.c, and the linker wraps clock_gettime() (see the linksim rule
+ * of the Makefile) so that the pacing clock reads the simulator's too.
+ * Endpoint A sends "bytes" of a fixed pattern to B over a link modelled
+ * as discrete events on a virtual clock in ns. Each direction serializes
+ * packets at the link bandwidth behind a drop-tail queue, adds the
+ * one-way delay plus uniform jitter (packets still arrive in order), and
+ * loses, reorders (holds back by reorder_ms), duplicates or corrupts
+ * packets with the given probabilities, all drawn from one seeded
+ * generator. Nothing reads the wall clock, so a seed replays the same run
+ * to the segment, and idle time is skipped: a 1 GB transfer over a 100 ms
+ * link takes seconds. Each packet reaches its end through ctcp_receive()
+ * in a heap copy of its own, the way ctcp_sys.c delivers it. B checks
+ * every byte it is handed. Goodput, retransmissions and link drops go
+ * out as one JSON document on stdout.
+ *
+ *   linksim [bytes=N] [bw=Mbit/s] [rtt=ms] [jitter=ms] [loss=p]
+ *           [reorder=p] [reorder_ms=ms] [dup=p] [corrupt=p]
+ *           [queue=packets] [window=bytes] [cc=newreno|cubic]
+ *           [seed=N] [limit=s] [max_rtx=N]
+ *
+ * queue and window default to one and two bandwidth-delay products. The
+ * run verifies when B got the whole stream intact and the two ends
+ * retransmitted no more than max_rtx segments between them (no limit by
+ * default). With max_rtx=0 on a link that drops nothing, any spurious
+ * timeout or fast retransmit fails the run; "make linksim-check" runs
+ * that scenario.
+ */
+#define LINKSIM_START 1000000000ull /* Virtual clock at start, ns; 0 means "unset" in places */
+#define LINKSIM_PACKET (sizeof(ctcp_segment_t) + MAX_SEG_DATA_SIZE)
+
+static uint64_t linksim_now;    /* Virtual clock, ns */
+
+typedef struct linksim_link{
+  uint64_t bandwidth;       /* bits/s */
+  uint64_t delay;           /* One way, ns */
+  uint64_t jitter;          /* Up to this much on top of delay, ns */
+  uint64_t reorder_delay;   /* On top of that for reordered packets, ns */
+  double loss;
+  double reorder;
+  double dup;
+  double corrupt;
+  uint64_t queue;           /* Bytes that may wait for the wire */
+  uint64_t busy_until;      /* Wire free again, ns */
+  uint64_t last_arrival;    /* Jitter does not overtake it, ns */
+  struct conn *to;
+
+  uint64_t packets;         /* Handed to conn_send() */
+  uint64_t bytes;
+  uint64_t lost;
+  uint64_t queue_drops;
+  uint64_t reordered;
+  uint64_t duplicated;
+  uint64_t corrupted;
+}linksim_link_t;
+
+struct conn{
+  ctcp_state_t *state;      /* NULL once conn_remove()d */
+  ctcp_config_t config;     /* ctcp_init() keeps a pointer */
+  linksim_link_t link;      /* Towards the peer */
+  uint64_t input_left;
+  uint64_t input_offset;    /* Pattern bytes handed out by conn_input() */
+  uint64_t output_offset;   /* Pattern bytes checked by conn_output() */
+  uint64_t output_errors;   /* Bytes that did not match the pattern */
+  bool eof;
+  uint64_t eof_at;          /* ns */
+  ctcp_stats_t stats;       /* Taken in conn_remove() */
+};
+
+typedef struct linksim_event{
+  uint64_t at;              /* ns */
+  uint64_t order;           /* Ties run in the order they were scheduled */
+  conn_t *to;               /* NULL for a ctcp_timer() call */
+  size_t len;
+  struct linksim_event *next_free;
+  char data[LINKSIM_PACKET];
+}linksim_event_t;
+
+static struct{
+  linksim_event_t **heap;   /* Binary min-heap on (at, order) */
+  size_t count;
+  size_t size;
+  uint64_t order;
+  linksim_event_t *free;
+  uint64_t rng;             /* xorshift64* state */
+  uint64_t timer_at;        /* Earliest pending ctcp_timer() call */
+  uint64_t events;
+}linksim;
+
+static uint64_t linksim_random(void)
+{
+  linksim.rng ^= linksim.rng >> 12;
+  linksim.rng ^= linksim.rng << 25;
+  linksim.rng ^= linksim.rng >> 27;
+  return linksim.rng * 0x2545f4914f6cdd1dull;
+}
+
+static bool linksim_chance(double p)
+{
+  return p > 0 && (linksim_random() >> 11) * (1.0 / 9007199254740992.0) < p;
+}
+
+static bool linksim_before(const linksim_event_t *a, const linksim_event_t *b)
+{
+  return a->at < b->at || (a->at == b->at && a->order < b->order);
+}
+
+static linksim_event_t *linksim_push(uint64_t at, conn_t *to, const void *data, size_t len)
+{
+  linksim_event_t *event = linksim.free;
+  size_t index, parent;
+
+  if (event != NULL)
+  {
+    linksim.free = event->next_free;
+  }
+  else
+  {
+    event = malloc(sizeof(linksim_event_t));
+  }
+  if (linksim.count == linksim.size)
+  {
+    linksim.size = linksim.size ? linksim.size * 2 : 1024;
+    linksim.heap = realloc(linksim.heap,linksim.size * sizeof(linksim_event_t*));
+  }
+  event->at = at;
+  event->order = linksim.order ++;
+  event->to = to;
+  event->len = len;
+  if (len > 0)
+  {
+    memcpy(event->data,data,len);
+  }
+
+  for (index = linksim.count ++; index > 0; index = parent)
+  {
+    parent = (index - 1) / 2;
+    if (!linksim_before(event,linksim.heap[parent]))
+    {
+      break;
+    }
+    linksim.heap[index] = linksim.heap[parent];
+  }
+  linksim.heap[index] = event;
+  return event;
+}
+
+static linksim_event_t *linksim_pop(void)
+{
+  linksim_event_t *first = linksim.heap[0];
+  linksim_event_t *last = linksim.heap[-- linksim.count];
+  size_t index = 0, child;
+
+  while ((child = index * 2 + 1) < linksim.count)
+  {
+    if (child + 1 < linksim.count && linksim_before(linksim.heap[child + 1],linksim.heap[child]))
+    {
+      child ++;
+    }
+    if (!linksim_before(linksim.heap[child],last))
+    {
+      break;
+    }
+    linksim.heap[index] = linksim.heap[child];
+    index = child;
+  }
+  linksim.heap[index] = last;
+  return first;
+}
+
+/* Wake up for the next timer wheel deadline, unless something earlier is queued */
+static void linksim_schedule_timer(void)
+{
+  uint64_t at = ((uint64_t)current_time() + ctcp_timer_next()) * 1000000;
+
+  if (at < linksim_now)
+  {
+    at = linksim_now;
+  }
+  if (at < linksim.timer_at)
+  {
+    linksim.timer_at = at;
+    linksim_push(at,NULL,NULL,0);
+  }
+}
+
+/* Byte "offset" of the stream A sends */
+static inline uint8_t linksim_pattern(uint64_t offset)
+{
+  uint64_t word = ((offset >> 3) + 1) * 0x9e3779b97f4a7c15ull;
+
+  return word >> ((offset & 7) * 8);
+}
+
+long current_time()
+{
+  return linksim_now / 1000000;
+}
+
+int __real_clock_gettime(clockid_t clock, struct timespec *now);
+
+/* Every clock cTCP reads is the virtual one */
+int __wrap_clock_gettime(clockid_t clock, struct timespec *now)
+{
+  (void)clock;
+  now->tv_sec = linksim_now / 1000000000;
+  now->tv_nsec = linksim_now % 1000000000;
+  return 0;
+}
+
+int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len)
+{
+  linksim_link_t *link = &conn->link;
+  uint64_t start = (link->busy_until > linksim_now) ? link->busy_until : linksim_now;
+  uint64_t at;
+  linksim_event_t *event;
+
+  link->packets ++;
+  link->bytes += len;
+  if ((double)(start - linksim_now) * link->bandwidth / 8e9 + len > link->queue)
+  {
+    link->queue_drops ++;
+    return len;
+  }
+  // Lost packets still took their time on the wire
+  link->busy_until = start + len * 8000000000ull / link->bandwidth;
+  if (linksim_chance(link->loss))
+  {
+    link->lost ++;
+    return len;
+  }
+  at = link->busy_until + link->delay;
+  if (link->jitter > 0)
+  {
+    at += linksim_random() % (link->jitter + 1);
+  }
+  if (at < link->last_arrival)
+  {
+    at = link->last_arrival;
+  }
+  if (linksim_chance(link->reorder))
+  {
+    // Held back, what follows overtakes it
+    link->reordered ++;
+    at += link->reorder_delay;
+  }
+  else
+  {
+    link->last_arrival = at;
+  }
+  event = linksim_push(at,link->to,segment,len);
+  if (linksim_chance(link->corrupt))
+  {
+    link->corrupted ++;
+    event->data[linksim_random() % len] ^= 1 << (linksim_random() % 8);
+  }
+  if (linksim_chance(link->dup))
+  {
+    link->duplicated ++;
+    linksim_push(at,link->to,segment,len);
+  }
+  return len;
+}
+
+int conn_input(conn_t *conn, void *buf, size_t len)
+{
+  uint8_t *data = buf;
+  size_t index;
+
+  if (conn->input_left == 0)
+  {
+    return -1;
+  }
+  if (len > conn->input_left)
+  {
+    len = conn->input_left;
+  }
+  for (index = 0; index < len; index++)
+  {
+    data[index] = linksim_pattern(conn->input_offset + index);
+  }
+  conn->input_offset += len;
+  conn->input_left -= len;
+  return len;
+}
+
+int conn_output(conn_t *conn, const char *buf, size_t len)
+{
+  const uint8_t *data = (const uint8_t*)buf;
+  size_t index;
+
+  if (len == 0)
+  {
+    conn->eof = true;
+    conn->eof_at = linksim_now;
+    return 0;
+  }
+  for (index = 0; index < len; index++)
+  {
+    conn->output_errors += (data[index] != linksim_pattern(conn->output_offset + index));
+  }
+  conn->output_offset += len;
+  return len;
+}
+
+size_t conn_bufspace(conn_t *conn)
+{
+  (void)conn;
+  return 1 << 20;
+}
+
+void conn_remove(conn_t *conn)
+{
+  conn->stats = conn->state->stats;
+  conn->state = NULL;
+}
+
+void end_client()
+{
+}
+
+static void linksim_print_link(const char *name, const linksim_link_t *link)
+{
+  printf("\"%s\": {\"packets\": %llu, \"bytes\": %llu, \"lost\": %llu, \"queue_drops\": %llu, "
+         "\"reordered\": %llu, \"duplicated\": %llu, \"corrupted\": %llu}",name,
+         (unsigned long long)link->packets,(unsigned long long)link->bytes,
+         (unsigned long long)link->lost,(unsigned long long)link->queue_drops,
+         (unsigned long long)link->reordered,(unsigned long long)link->duplicated,
+         (unsigned long long)link->corrupted);
+}
+
+int main(int argc, char **argv)
+{
+  static conn_t ends[2];
+  conn_t *sender = &ends[0], *receiver = &ends[1];
+  linksim_link_t link;
+  linksim_event_t *event;
+  ctcp_segment_t *segment;
+  cc_type_t cc = CC_DEFAULT;
+  uint64_t bytes = 1000000000ull, window = 0, seed = 1, limit = 3600, queue = 0;
+  uint64_t max_rtx = UINT64_MAX, retransmitted;
+  double bandwidth = 100, rtt = 100, jitter = 0, reorder_ms = 2;
+  double virtual_s, goodput;
+  struct timespec wall_start, wall_end;
+  bool complete, verified;
+  int arg, index;
+
+  memset(&link,0,sizeof(link));
+  for (arg = 1; arg < argc; arg++)
+  {
+    char *value = strchr(argv[arg],'=');
+
+    if (value == NULL)
+    {
+      fprintf(stderr,"usage: %s [key=value ...], see ctcp_linksim.c\n",argv[0]);
+      return 2;
+    }
+    *value ++ = '\0';
+    if (!strcmp(argv[arg],"bytes")) bytes = strtoull(value,NULL,0);
+    else if (!strcmp(argv[arg],"bw")) bandwidth = atof(value);
+    else if (!strcmp(argv[arg],"rtt")) rtt = atof(value);
+    else if (!strcmp(argv[arg],"jitter")) jitter = atof(value);
+    else if (!strcmp(argv[arg],"loss")) link.loss = atof(value);
+    else if (!strcmp(argv[arg],"reorder")) link.reorder = atof(value);
+    else if (!strcmp(argv[arg],"reorder_ms")) reorder_ms = atof(value);
+    else if (!strcmp(argv[arg],"dup")) link.dup = atof(value);
+    else if (!strcmp(argv[arg],"corrupt")) link.corrupt = atof(value);
+    else if (!strcmp(argv[arg],"queue")) queue = strtoull(value,NULL,0);
+    else if (!strcmp(argv[arg],"window")) window = strtoull(value,NULL,0);
+    else if (!strcmp(argv[arg],"cc")) cc = strcmp(value,"cubic") ? CC_NEWRENO : CC_CUBIC;
+    else if (!strcmp(argv[arg],"seed")) seed = strtoull(value,NULL,0);
+    else if (!strcmp(argv[arg],"limit")) limit = strtoull(value,NULL,0);
+    else if (!strcmp(argv[arg],"max_rtx")) max_rtx = strtoull(value,NULL,0);
+    else
+    {
+      fprintf(stderr,"%s: unknown parameter %s\n",argv[0],argv[arg]);
+      return 2;
+    }
+  }
+  if (bandwidth <= 0)
+  {
+    fprintf(stderr,"%s: bw must be positive\n",argv[0]);
+    return 2;
+  }
+
+  link.bandwidth = bandwidth * 1e6;
+  link.delay = rtt * 1e6 / 2;
+  link.jitter = jitter * 1e6;
+  link.reorder_delay = reorder_ms * 1e6;
+  // Bandwidth-delay product
+  link.queue = bandwidth * 1e6 / 8 * rtt / 1000;
+  if (link.queue < 4 * LINKSIM_PACKET)
+  {
+    link.queue = 4 * LINKSIM_PACKET;
+  }
+  if (window == 0)
+  {
+    window = 2 * link.queue;
+  }
+  if (queue > 0)
+  {
+    link.queue = queue * LINKSIM_PACKET;
+  }
+  linksim.rng = seed * 0x9e3779b97f4a7c15ull + 1;
+  linksim.timer_at = UINT64_MAX;
+  linksim_now = LINKSIM_START;
+
+  for (index = 0; index < 2; index++)
+  {
+    ends[index].link = link;
+    ends[index].link.to = &ends[!index];
+    ends[index].config.recv_window = 0xffff;
+    ends[index].config.send_window = 0xffff;
+    ends[index].config.timer = 10;
+    ends[index].config.rt_timeout = 200;
+    ends[index].state = ctcp_init(&ends[index],&ends[index].config);
+    ctcp_set_windows(ends[index].state,window,window);
+    ctcp_set_congestion_control(ends[index].state,cc);
+  }
+  sender->input_left = bytes;
+
+  __real_clock_gettime(CLOCK_MONOTONIC,&wall_start);
+  ctcp_read(sender->state);
+  ctcp_read(receiver->state);
+  linksim_schedule_timer();
+  while (linksim.count > 0 && (sender->state != NULL || receiver->state != NULL) &&
+         linksim_now - LINKSIM_START < limit * 1000000000ull)
+  {
+    event = linksim_pop();
+    linksim.events ++;
+    linksim_now = event->at;
+    if (event->to == NULL)
+    {
+      // Superseded by an earlier wake-up, which rescheduled the next one
+      if (event->at == linksim.timer_at)
+      {
+        linksim.timer_at = UINT64_MAX;
+        ctcp_timer();
+      }
+    }
+    else if (event->to->state != NULL)
+    {
+      // ctcp_receive() frees the segment
+      segment = malloc(event->len);
+      memcpy(segment,event->data,event->len);
+      ctcp_receive(event->to->state,segment,event->len);
+      // Input is always ready: the sender refills what the ACK freed
+      if (event->to->state != NULL)
+      {
+        ctcp_read(event->to->state);
+      }
+    }
+    event->next_free = linksim.free;
+    linksim.free = event;
+    linksim_schedule_timer();
+  }
+  __real_clock_gettime(CLOCK_MONOTONIC,&wall_end);
+
+  for (index = 0; index < 2; index++)
+  {
+    if (ends[index].state != NULL)
+    {
+      ctcp_destroy(ends[index].state);
+    }
+  }
+  complete = receiver->eof && receiver->output_offset == bytes;
+  retransmitted = sender->stats.segments_retransmitted + receiver->stats.segments_retransmitted;
+  verified = complete && receiver->output_errors == 0 && retransmitted <= max_rtx;
+  virtual_s = (double)((receiver->eof ? receiver->eof_at : linksim_now) - LINKSIM_START) / 1e9;
+  goodput = virtual_s > 0 ? receiver->output_offset * 8 / virtual_s / 1e6 : 0;
+
+  printf("{\"seed\": %llu, \"bytes\": %llu, \"bandwidth_mbit\": %g, \"rtt_ms\": %g, "
+         "\"jitter_ms\": %g, \"loss\": %g, \"reorder\": %g, \"dup\": %g, \"corrupt\": %g, "
+         "\"queue_bytes\": %llu, \"window\": %llu, \"cc\": \"%s\",\n",
+         (unsigned long long)seed,(unsigned long long)bytes,bandwidth,rtt,jitter,link.loss,
+         link.reorder,link.dup,link.corrupt,(unsigned long long)link.queue,
+         (unsigned long long)window,cc == CC_CUBIC ? "cubic" : "newreno");
+  printf("\"complete\": %s, \"verified\": %s, \"delivered\": %llu, \"mismatched\": %llu, "
+         "\"virtual_s\": %.6f, \"wall_s\": %.3f, \"events\": %llu, \"goodput_mbit\": %.3f, "
+         "\"utilization\": %.4f, \"retransmit_ratio\": %.6f,\n",
+         complete ? "true" : "false",verified ? "true" : "false",
+         (unsigned long long)receiver->output_offset,(unsigned long long)receiver->output_errors,
+         virtual_s,(wall_end.tv_sec - wall_start.tv_sec) +
+         (wall_end.tv_nsec - wall_start.tv_nsec) / 1e9,(unsigned long long)linksim.events,
+         goodput,goodput / bandwidth,sender->stats.segments_sent ?
+         (double)sender->stats.segments_retransmitted / sender->stats.segments_sent : 0.0);
+  printf("\"link\": {");
+  linksim_print_link("forward",&sender->link);
+  printf(", ");
+  linksim_print_link("reverse",&receiver->link);
+  printf("},\n\"sender\": ");
+  ctcp_stats_print(stdout,&sender->stats);
+  printf(",\n\"receiver\": ");
+  ctcp_stats_print(stdout,&receiver->stats);
+  printf("}\n");
+  return verified ? 0 : 1;
+}
@@ -0,0 +1,341 @@
+/******************************************************************************
+ * ctcp_shard_bench.c
+ * ------------------
+ * Loopback scaling benchmark for the sharded runtime, with ctcp.c compiled
+ * in. Build and run with "make shard-bench".
+ *
+ *****************************************************************************/
+
+#define SHARD_RUNTIME 1
+#include "ctcp.c"
+#include <poll.h>
+
+/**
+ * Loopback scaling benchmark
+ *
+ * Linked against ctcp_utils.c and ctcp_linked_list.c instead of
+ * ctcp_sys.c: the conn_*() calls below move segments over UDP on
+ * 127.0.0.1. Every worker opens SHARD_BENCH_CONNS connections to the
+ * SO_REUSEPORT port, each sending SHARD_BENCH_BYTES, and serves whichever
+ * flows the kernel hashes to its own socket. The run is repeated for 1 to
+ * N workers (argv[1], default every online CPU) and the aggregate goodput
+ * printed.
+ */
+#define SHARD_BENCH_PORT 41440
+#define SHARD_BENCH_CONNS 8
+#define SHARD_BENCH_BYTES (32 << 20)
+#define SHARD_BENCH_TIMEOUT 60000 /* ms, a run gives up after this */
+
+struct conn{
+  struct conn *next;        /* In the worker's list */
+  ctcp_state_t *state;      /* NULL once conn_remove()d */
+  int fd;
+  bool client;              /* Own connected socket, else the worker's one */
+  struct sockaddr_in peer;
+  uint64_t input_left;      /* Bytes conn_input() still hands out */
+  uint64_t *output;         /* Goodput counter of the worker */
+  bool done;                /* EOF delivered or removed, no longer live */
+};
+
+typedef struct shard_bench{
+  pthread_barrier_t ready;  /* Every socket of the group is bound */
+  int live;                 /* Connections not done yet, all workers */
+  uint64_t received[SHARD_MAX_WORKERS * 8]; /* One cache line per worker */
+}shard_bench_t;
+
+static shard_bench_t *shard_bench;
+
+int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len)
+{
+  if (conn->client)
+  {
+    return send(conn->fd,segment,len,0);
+  }
+  return sendto(conn->fd,segment,len,0,(struct sockaddr*)&conn->peer,sizeof(conn->peer));
+}
+
+int conn_send_batch(conn_t *conn, ctcp_segment_t **segments, size_t *lens, int count)
+{
+  struct mmsghdr msgs[TX_BATCH_MAX];
+  struct iovec iov[TX_BATCH_MAX];
+  int index;
+
+  memset(msgs,0,sizeof(msgs[0]) * count);
+  for (index = 0; index < count; index++)
+  {
+    iov[index].iov_base = segments[index];
+    iov[index].iov_len = lens[index];
+    msgs[index].msg_hdr.msg_iov = &iov[index];
+    msgs[index].msg_hdr.msg_iovlen = 1;
+    if (!conn->client)
+    {
+      msgs[index].msg_hdr.msg_name = &conn->peer;
+      msgs[index].msg_hdr.msg_namelen = sizeof(conn->peer);
+    }
+  }
+  return sendmmsg(conn->fd,msgs,count,0);
+}
+
+int conn_input(conn_t *conn, void *buf, size_t len)
+{
+  if (conn->input_left == 0)
+  {
+    return -1;
+  }
+  if (len > conn->input_left)
+  {
+    len = conn->input_left;
+  }
+  memset(buf,'x',len);
+  conn->input_left -= len;
+  return len;
+}
+
+/* Done at EOF, a lingering connection does not hold the run up */
+static void shard_bench_done(conn_t *conn)
+{
+  if (!conn->done)
+  {
+    conn->done = true;
+    __atomic_sub_fetch(&shard_bench->live,1,__ATOMIC_RELAXED);
+  }
+}
+
+int conn_output(conn_t *conn, const char *buf, size_t len)
+{
+  if (buf == NULL && len == 0)
+  {
+    shard_bench_done(conn);
+  }
+  *conn->output += len;
+  return len;
+}
+
+size_t conn_bufspace(conn_t *conn)
+{
+  (void)conn;
+  return 1 << 20;
+}
+
+void conn_remove(conn_t *conn)
+{
+  conn->state = NULL;
+  shard_bench_done(conn);
+}
+
+void end_client()
+{
+}
+
+static double shard_bench_ms(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC,&now);
+  return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+/* Datagrams of one socket, handed to their connections in runs */
+static void shard_bench_receive(int fd, conn_t **conns, conn_t *server,
+                                ctcp_config_t *config)
+{
+  static __thread char buffers[RX_BATCH_MAX][sizeof(ctcp_segment_t) + MAX_SEG_DATA_SIZE];
+  struct mmsghdr msgs[RX_BATCH_MAX];
+  struct iovec iov[RX_BATCH_MAX];
+  struct sockaddr_in addrs[RX_BATCH_MAX];
+  ctcp_segment_t *segments[RX_BATCH_MAX];
+  size_t lens[RX_BATCH_MAX];
+  conn_t *owner[RX_BATCH_MAX];
+  conn_t *conn;
+  int count, index, first;
+
+  memset(msgs,0,sizeof(msgs));
+  for (index = 0; index < RX_BATCH_MAX; index++)
+  {
+    iov[index].iov_base = buffers[index];
+    iov[index].iov_len = sizeof(buffers[index]);
+    msgs[index].msg_hdr.msg_iov = &iov[index];
+    msgs[index].msg_hdr.msg_iovlen = 1;
+    msgs[index].msg_hdr.msg_name = &addrs[index];
+    msgs[index].msg_hdr.msg_namelen = sizeof(addrs[index]);
+  }
+  count = recvmmsg(fd,msgs,RX_BATCH_MAX,MSG_DONTWAIT,NULL);
+
+  for (index = 0; index < count; index++)
+  {
+    segments[index] = (ctcp_segment_t*)buffers[index];
+    lens[index] = msgs[index].msg_len;
+    owner[index] = server;
+    if (server != NULL)
+    {
+      continue;
+    }
+    // Listening socket: find the flow, or accept it
+    for (conn = *conns; conn != NULL; conn = conn->next)
+    {
+      if (!conn->client && conn->peer.sin_port == addrs[index].sin_port &&
+          conn->peer.sin_addr.s_addr == addrs[index].sin_addr.s_addr)
+      {
+        break;
+      }
+    }
+    if (conn == NULL)
+    {
+      conn = calloc(sizeof(conn_t),1);
+      conn->fd = fd;
+      conn->peer = addrs[index];
+      conn->output = (*conns)->output;
+      conn->next = *conns;
+      *conns = conn;
+      conn->state = ctcp_init(conn,config);
+    }
+    owner[index] = conn;
+  }
+
+  for (first = 0; first < count; first = index)
+  {
+    for (index = first + 1; index < count && owner[index] == owner[first]; index++)
+      ;
+    if (owner[first]->state != NULL)
+    {
+      ctcp_receive_batch(owner[first]->state,segments + first,lens + first,index - first);
+    }
+  }
+}
+
+static void shard_bench_worker(int id, void *arg)
+{
+  ctcp_config_t config;
+  struct sockaddr_in addr;
+  struct pollfd fds[SHARD_BENCH_CONNS + 1];
+  conn_t *conns = NULL;
+  conn_t *client[SHARD_BENCH_CONNS];
+  conn_t *conn;
+  uint64_t *received = &shard_bench->received[id * 8];
+  double deadline = shard_bench_ms() + SHARD_BENCH_TIMEOUT;
+  int index, listen_fd;
+
+  (void)arg;
+  config.recv_window = 0xffff;
+  config.send_window = 0xffff;
+  config.timer = 10;
+  config.rt_timeout = 200;
+
+  listen_fd = ctcp_shard_socket(SHARD_BENCH_PORT);
+  pthread_barrier_wait(&shard_bench->ready);
+
+  memset(&addr,0,sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(SHARD_BENCH_PORT);
+  for (index = 0; index < SHARD_BENCH_CONNS; index++)
+  {
+    conn = calloc(sizeof(conn_t),1);
+    conn->fd = socket(AF_INET,SOCK_DGRAM | SOCK_NONBLOCK,0);
+    connect(conn->fd,(struct sockaddr*)&addr,sizeof(addr));
+    conn->client = true;
+    conn->input_left = SHARD_BENCH_BYTES;
+    conn->output = received;
+    conn->next = conns;
+    conns = conn;
+    client[index] = conn;
+    conn->state = ctcp_init(conn,&config);
+    fds[index + 1].fd = conn->fd;
+    fds[index + 1].events = POLLIN;
+  }
+  fds[0].fd = listen_fd;
+  fds[0].events = POLLIN;
+
+  while (__atomic_load_n(&shard_bench->live,__ATOMIC_RELAXED) > 0 &&
+         shard_bench_ms() < deadline)
+  {
+    poll(fds,SHARD_BENCH_CONNS + 1,ctcp_timer_next() ? 1 : 0);
+    if (fds[0].revents & POLLIN)
+    {
+      shard_bench_receive(listen_fd,&conns,NULL,&config);
+    }
+    for (index = 0; index < SHARD_BENCH_CONNS; index++)
+    {
+      if (fds[index + 1].revents & POLLIN)
+      {
+        shard_bench_receive(client[index]->fd,&conns,client[index],&config);
+      }
+    }
+    // Input never blocks: top the send rings up every round
+    for (conn = conns; conn != NULL; conn = conn->next)
+    {
+      if (conn->state != NULL)
+      {
+        ctcp_read(conn->state);
+      }
+    }
+    if (ctcp_timer_next() == 0)
+    {
+      ctcp_timer();
+    }
+  }
+
+  // Lingering connections, and whatever did not finish in time, go down
+  // with the run
+  while ((conn = conns) != NULL)
+  {
+    conns = conn->next;
+    if (conn->state != NULL)
+    {
+      ctcp_destroy(conn->state);
+    }
+    if (conn->client)
+    {
+      close(conn->fd);
+    }
+    free(conn);
+  }
+  close(listen_fd);
+}
+
+int main(int argc, char **argv)
+{
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  int workers = (argc > 1) ? atoi(argv[1]) : (int)cores;
+  int count, index;
+  double start, elapsed, base = 0;
+  uint64_t total;
+
+  if (workers < 1 || workers > SHARD_MAX_WORKERS)
+  {
+    workers = (cores < SHARD_MAX_WORKERS) ? (int)cores : SHARD_MAX_WORKERS;
+  }
+  shard_bench = calloc(sizeof(shard_bench_t),1);
+  printf("{\"bench\": \"shard_loopback\", \"conns_per_worker\": %d, \"bytes_per_conn\": %d, \"runs\": [\n",
+         SHARD_BENCH_CONNS,SHARD_BENCH_BYTES);
+  for (count = 1; count <= workers; count++)
+  {
+    memset(shard_bench,0,sizeof(shard_bench_t));
+    pthread_barrier_init(&shard_bench->ready,NULL,count);
+    // Both ends of every connection
+    shard_bench->live = count * SHARD_BENCH_CONNS * 2;
+
+    start = shard_bench_ms();
+    ctcp_shard_run(count,shard_bench_worker,NULL);
+    elapsed = shard_bench_ms() - start;
+    pthread_barrier_destroy(&shard_bench->ready);
+
+    total = 0;
+    for (index = 0; index < count; index++)
+    {
+      total += shard_bench->received[index * 8];
+    }
+    if (count == 1)
+    {
+      base = total / elapsed;
+    }
+    printf("  {\"workers\": %d, \"bytes\": %llu, \"ms\": %.1f, \"mbit_s\": %.1f, \"speedup\": %.2f, \"unfinished\": %d}%s\n",
+           count,(unsigned long long)total,elapsed,total * 8 / elapsed / 1e3,
+           base > 0 ? total / elapsed / base : 0,shard_bench->live,
+           count < workers ? "," : "");
+    fflush(stdout);
+  }
+  printf("]}\n");
+  free(shard_bench);
+  return 0;
+}
@@ -0,0 +1,49 @@
+/******************************************************************************
+ * ctcp_trace.h
+ * ------------
+ * Layout of a cTCP trace dump, shared by ctcp.c, which writes it from
+ * ctcp_trace_dump(), and ctcp_trace_decode.c, which prints it as text.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_TRACE_H
+#define CTCP_TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_MAGIC 0x43545243  /* "CTRC" */
+
+enum trace_event{
+  TRACE_SEND = 1,               /* Data or FIN segment, first transmission */
+  TRACE_RETRANSMIT,
+  TRACE_ACK,                    /* Pure ACK, len is the SACK block count */
+  TRACE_RECV,                   /* Segment passed the checksum */
+  TRACE_CORRUPT,                /* seqno: checksum received, ackno: computed */
+  TRACE_RTO,                    /* len is the RTO in ms */
+  TRACE_FAST_RETRANSMIT,
+  TRACE_DELIVER,                /* seqno: first byte handed to conn_output() */
+  TRACE_WINDOW_SHUT,            /* ackno: send_base, len: window */
+  TRACE_PACING_HOLD,            /* ackno: tokens, len: segment */
+  TRACE_EVENTS
+};
+
+typedef struct trace_record{
+  uint64_t ticks;
+  uint32_t seqno;
+  uint32_t ackno;
+  uint16_t len;
+  uint16_t event;
+  uint32_t conn;                /* Low bits of the state, tells flows apart */
+}trace_record_t;
+
+/* Dump file: this header, then "count" records oldest first */
+typedef struct trace_header{
+  uint32_t magic;
+  uint32_t count;
+  uint64_t start_ticks;
+  uint64_t start_us;
+  uint64_t end_ticks;
+  uint64_t end_us;
+}trace_header_t;
+
+#endif /* CTCP_TRACE_H */
@@ -0,0 +1,43 @@
+/******************************************************************************
+ * ctcp_trace_decode.c
+ * -------------------
+ * Offline decoder for ctcp_trace_dump() output: reads a dump (file argument
+ * or stdin) and prints one record per line, with its time in ms since the
+ * first record.
+ *
+ *****************************************************************************/
+
+#include "ctcp_trace.h"
+#include <stdio.h>
+
+/* Indexed by enum trace_event */
+static const char *const trace_event_names[TRACE_EVENTS] = {
+  "?", "send", "retransmit", "ack", "recv", "corrupt", "rto",
+  "fast_retransmit", "deliver", "window_shut", "pacing_hold"
+};
+
+int main(int argc, char **argv)
+{
+  FILE *in = (argc > 1) ? fopen(argv[1],"rb") : stdin;
+  trace_header_t header;
+  trace_record_t record;
+  double us_per_tick = 0;
+
+  if (in == NULL || fread(&header,sizeof(header),1,in) != 1 || header.magic != TRACE_MAGIC)
+  {
+    fprintf(stderr,"%s: not a cTCP trace\n",(argc > 1) ? argv[1] : "stdin");
+    return 1;
+  }
+  if (header.end_ticks > header.start_ticks)
+  {
+    us_per_tick = (double)(header.end_us - header.start_us) / (header.end_ticks - header.start_ticks);
+  }
+  while (fread(&record,sizeof(record),1,in) == 1)
+  {
+    printf("%12.3f  %08x  %-16s seq %10u  ack %10u  len %5u\n",
+           (double)(int64_t)(record.ticks - header.start_ticks) * us_per_tick / 1000,
+           record.conn,(record.event < TRACE_EVENTS) ? trace_event_names[record.event] : "?",
+           record.seqno,record.ackno,record.len);
+  }
+  return 0;
+}